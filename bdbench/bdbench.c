@@ -0,0 +1,548 @@
+// Host-native benchmark and fuzzer for the kernel's buddy allocators.
+//
+// Links one allocator variant from kernel/ against shim.c and drives
+// its bd_ops with synthetic workloads or with a trace
+// recorded by a BD_TRACE kernel (the output of bd_trace_dump()).
+// For every workload it reports operations per second, median and
+// p99 latency, failed allocations and the fragmentation left behind,
+// plus the arena bytes the variant keeps for its metadata.  Every
+// block is filled with a pattern that is checked when it is freed,
+// so overlapping or out-of-range blocks abort the run.
+//
+// usage: bdbench-<variant> [-m arena-MB] [-n ops] [-s seed] [-t tracefile]
+
+#define printf libc_printf
+#include <stdio.h>
+#undef printf
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned long uint64;
+
+#include "../kernel/bdstat.h"
+#include "../kernel/bdops.h"
+
+#define bd_malloc(n)  bd_ops.malloc(n)
+#define bd_free(p)    bd_ops.free(p)
+
+extern int bdb_cpu;
+
+#define NCPU_SIM  3        // CPUs the driver rotates through, as CPUS=3
+#define NLIVE     4096     // live blocks per workload
+#define LEAF      16
+
+struct blk {
+  char *p;
+  uint64 n;
+  uint64 tag;        // address recorded in a replayed trace
+};
+
+static char *arena;
+static uint64 arenasz;
+static struct blk live[NLIVE];
+static void *(*alloc)(uint64);   // bd_ops.malloc, or malloc_trim
+static uint64 *lat;        // per-operation latency, ns
+static long nlat;
+
+static uint64
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+fail(char *what, struct blk *b)
+{
+  fflush(stdout);
+  fprintf(stderr, "bdbench: %s: block %p size %lu\n", what, b->p, b->n);
+  exit(1);
+}
+
+static char
+pattern(struct blk *b)
+{
+  return (char)((uint64)b->p >> 4) | 1;
+}
+
+// Distance between pattern bytes.  Blocks over 1MB are only sampled,
+// so that a multi-GB arena need not all be backed by host memory.
+static uint64
+stride(struct blk *b)
+{
+  return b->n > (1 << 20) ? (1 << 16) + 61 : 61;
+}
+
+static void
+fill(struct blk *b)
+{
+  char c = pattern(b);
+
+  if(b->p < arena || b->p + b->n > arena + arenasz)
+    fail("out of range", b);
+  for(uint64 i = 0; i < b->n; i += stride(b))
+    b->p[i] = c;
+  b->p[b->n - 1] = c;
+}
+
+static void
+check(struct blk *b)
+{
+  char c = pattern(b);
+
+  for(uint64 i = 0; i < b->n; i += stride(b))
+    if(b->p[i] != c)
+      fail("corrupted", b);
+  if(b->p[b->n - 1] != c)
+    fail("corrupted", b);
+}
+
+static int
+do_alloc(struct blk *b, uint64 n)
+{
+  uint64 t0;
+
+  bdb_cpu = (bdb_cpu + 1) % NCPU_SIM;
+  t0 = now();
+  b->p = alloc(n);
+  lat[nlat++] = now() - t0;
+  if(b->p == 0)
+    return -1;
+  b->n = n;
+  fill(b);
+  return 0;
+}
+
+static void
+do_free(struct blk *b)
+{
+  uint64 t0;
+
+  check(b);
+  bdb_cpu = (bdb_cpu + 1) % NCPU_SIM;
+  t0 = now();
+  bd_free(b->p);
+  lat[nlat++] = now() - t0;
+  b->p = 0;
+}
+
+// Find the largest block that can still be allocated and the total
+// that can be allocated, by draining the per-CPU caches and taking
+// blocks of decreasing size until nothing is left, then giving them
+// all back.
+static void
+probe(uint64 *largest, uint64 *total)
+{
+  static void **taken;
+  long n = 0;
+  uint64 sz;
+  void *p;
+
+  if(taken == 0 && (taken = malloc(arenasz / LEAF * sizeof(void*))) == 0){
+    fprintf(stderr, "bdbench: out of memory\n");
+    exit(1);
+  }
+  // let blocks cached per CPU merge back first.
+  if(bd_ops.drain){
+    for(bdb_cpu = 0; bdb_cpu < NCPU_SIM; bdb_cpu++)
+      bd_ops.drain();
+    bdb_cpu = 0;
+  }
+  *largest = *total = 0;
+  for(sz = LEAF; sz * 2 <= arenasz; sz *= 2)
+    ;
+  for(; sz >= LEAF; sz /= 2){
+    while((p = bd_malloc(sz)) != 0){
+      taken[n++] = p;
+      *total += sz;
+      if(*largest == 0)
+        *largest = sz;
+    }
+  }
+  while(n > 0)
+    bd_free(taken[--n]);
+}
+
+static int
+cmp64(const void *a, const void *b)
+{
+  uint64 x = *(uint64*)a, y = *(uint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Splits plus merges so far: the bitmap work done by the allocator,
+// for variants that count it.
+static uint64
+traffic(void)
+{
+  struct bdstat st;
+
+  if(bd_ops.stat == 0)
+    return 0;
+  bd_ops.stat(&st);
+  return st.nsplits + st.nmerges;
+}
+
+static uint64 traffic0;
+
+// Start timing a workload.
+static void
+begin(void)
+{
+  nlat = 0;
+  traffic0 = traffic();
+}
+
+static void
+report(char *name, uint64 elapsed, long fails)
+{
+  uint64 largest, total, work;
+
+  work = traffic() - traffic0;
+  probe(&largest, &total);
+  qsort(lat, nlat, sizeof(lat[0]), cmp64);
+  fprintf(stdout, "  %-9s %9.0f ops/s  p50 %5lu ns  p99 %6lu ns  fails %6ld  frag %4lu/1000  split+merge/op %.2f\n",
+          name, nlat * 1e9 / (elapsed ? elapsed : 1),
+          nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0, fails,
+          total ? 1000 - largest * 1000 / total : 0,
+          nlat ? (double)work / nlat : 0);
+}
+
+static uint64 total0;      // bytes allocatable in the empty arena
+
+// Free every live block, then check that all memory came back.
+static void
+release_all(void)
+{
+  uint64 largest, total;
+
+  for(int i = 0; i < NLIVE; i++){
+    if(live[i].p){
+      check(&live[i]);
+      bd_free(live[i].p);
+      live[i].p = 0;
+    }
+  }
+  probe(&largest, &total);
+  if(total != total0){
+    fprintf(stderr, "bdbench: leaked %ld bytes\n", (long)(total0 - total));
+    exit(1);
+  }
+}
+
+// Synthetic workloads: random allocs and frees over nslot slots, with
+// sizes drawn by size().  size_huge asks for 1MB up to a quarter of
+// the arena, so that with -m over 2048 blocks land beyond 2GB.
+static uint64 size_small(void) { return 1 + rand() % 1024; }
+static uint64 size_page(void) { return 4096; }
+static uint64 size_mixed(void) { return 1 + rand() % (LEAF << (rand() % 15)); }
+
+static uint64
+size_huge(void)
+{
+  uint64 n = 1 << 20;
+
+  while(n < arenasz / 4 && rand() % 2)
+    n *= 2;
+  return n + LEAF * (rand() % (n / LEAF));
+}
+
+static void
+run_random(char *name, uint64 (*size)(void), int nslot, long nops)
+{
+  long fails = 0;
+  uint64 t0, elapsed;
+
+  begin();
+  t0 = now();
+  for(long op = 0; op < nops; op++){
+    struct blk *b = &live[rand() % nslot];
+    if(b->p)
+      do_free(b);
+    else if(do_alloc(b, size()) < 0)
+      fails++;
+  }
+  elapsed = now() - t0;
+  report(name, elapsed, fails);
+  release_all();
+}
+
+// Allocate a few blocks of the same size and free them again, over
+// and over: the worst case for an allocator that splits and merges
+// eagerly, since every round splits a larger block down and merges
+// it back up.
+#define PPN 4
+
+static void
+run_pingpong(char *name, uint64 n, long nops)
+{
+  struct blk b[PPN];
+  long fails = 0;
+  uint64 t0, elapsed;
+  int i;
+
+  begin();
+  t0 = now();
+  for(long op = 0; op < nops / (2 * PPN); op++){
+    for(i = 0; i < PPN; i++)
+      if(do_alloc(&b[i], n) < 0)
+        break;
+    fails += i < PPN;
+    while(--i >= 0)
+      do_free(&b[i]);
+  }
+  elapsed = now() - t0;
+  report(name, elapsed, fails);
+}
+
+// Grow random blocks to double their size and shrink others to half,
+// through bd_ops.realloc, checking that the contents survive.  Counts
+// how many resizes kept the block where it was.
+static void
+run_realloc(long nops)
+{
+  long fails = 0, inplace = 0, nresize = 0;
+  uint64 t0, t1, elapsed, n, keep;
+  char *q, c;
+
+  begin();
+  t0 = now();
+  for(long op = 0; op < nops; op++){
+    struct blk *b = &live[rand() % NLIVE];
+    if(b->p == 0){
+      if(do_alloc(b, LEAF << (rand() % 10)) < 0)
+        fails++;
+      continue;
+    }
+    n = (rand() % 2 && b->n > LEAF) ? b->n / 2 : b->n * 2;
+    keep = n < b->n ? n : b->n;
+    check(b);
+    c = pattern(b);
+    bdb_cpu = (bdb_cpu + 1) % NCPU_SIM;
+    t1 = now();
+    q = bd_ops.realloc(b->p, n);
+    lat[nlat++] = now() - t1;
+    nresize++;
+    if(q == 0){
+      fails++;
+      continue;
+    }
+    if(q == b->p)
+      inplace++;
+    for(uint64 i = 0; i < keep; i += stride(b))
+      if(q[i] != c)
+        fail("realloc lost data", b);
+    b->p = q;
+    b->n = n;
+    fill(b);
+  }
+  elapsed = now() - t0;
+  report("realloc", elapsed, fails);
+  fprintf(stdout, "  %-9s %ld of %ld resizes in place\n", "", inplace, nresize);
+  release_all();
+}
+
+// Allocate and free pages in batches of 32, as kalloc's per-CPU
+// lists do, through bd_ops.malloc_bulk and bd_ops.free_bulk.  Each
+// batch counts as one operation.
+#define BULK 32
+
+static void
+run_bulk(long nops)
+{
+  static void *pg[NLIVE / BULK][BULK];
+  static int npg[NLIVE / BULK];
+  long fails = 0;
+  uint64 t0, t1, elapsed;
+  struct blk b;
+
+  begin();
+  t0 = now();
+  for(long op = 0; op < nops / BULK; op++){
+    int i = rand() % (NLIVE / BULK);
+    bdb_cpu = (bdb_cpu + 1) % NCPU_SIM;
+    if(npg[i]){
+      for(int j = 0; j < npg[i]; j++){
+        b.p = pg[i][j];
+        b.n = 4096;
+        check(&b);
+      }
+      t1 = now();
+      bd_ops.free_bulk(pg[i], npg[i]);
+      lat[nlat++] = now() - t1;
+      npg[i] = 0;
+    } else {
+      t1 = now();
+      npg[i] = bd_ops.malloc_bulk(4096, BULK, pg[i]);
+      lat[nlat++] = now() - t1;
+      if(npg[i] < BULK)
+        fails++;
+      for(int j = 0; j < npg[i]; j++){
+        b.p = pg[i][j];
+        b.n = 4096;
+        fill(&b);
+      }
+    }
+  }
+  elapsed = now() - t0;
+  report("bulk", elapsed, fails);
+  for(int i = 0; i < NLIVE / BULK; i++){
+    bd_ops.free_bulk(pg[i], npg[i]);
+    npg[i] = 0;
+  }
+  release_all();
+}
+
+// Replay a trace printed by bd_trace_dump(): lines of the form
+//   cpu <c> tick <t> alloc k=<k> <addr>
+//   cpu <c> tick <t> free  k=<k> <addr>
+// Records are replayed in tick order.  Addresses are only used to
+// pair frees with allocs; frees whose alloc fell out of the ring are
+// skipped.
+struct rec {
+  uint64 tick;
+  long seq;
+  int alloc;
+  int k;
+  uint64 addr;
+};
+
+static int
+cmprec(const void *a, const void *b)
+{
+  const struct rec *x = a, *y = b;
+  if(x->tick != y->tick)
+    return x->tick < y->tick ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void
+run_trace(char *path)
+{
+  FILE *f;
+  char line[256], ev[16];
+  struct rec *r = 0;
+  long n = 0, cap = 0, fails = 0;
+  uint64 t0, elapsed;
+  int cpu;
+
+  if((f = fopen(path, "r")) == 0){
+    perror(path);
+    exit(1);
+  }
+  while(fgets(line, sizeof(line), f)){
+    struct rec x;
+    if(sscanf(line, "cpu %d tick %lu %15s k=%d %lx", &cpu, &x.tick, ev, &x.k, &x.addr) != 5)
+      continue;
+    if(strcmp(ev, "alloc") == 0)
+      x.alloc = 1;
+    else if(strcmp(ev, "free") == 0)
+      x.alloc = 0;
+    else
+      continue;
+    if(n == cap){
+      cap = cap ? 2 * cap : 1024;
+      if((r = realloc(r, cap * sizeof(*r))) == 0){
+        fprintf(stderr, "bdbench: out of memory\n");
+        exit(1);
+      }
+    }
+    x.seq = n;
+    r[n++] = x;
+  }
+  fclose(f);
+  qsort(r, n, sizeof(*r), cmprec);
+
+  if((lat = realloc(lat, (n + 1) * sizeof(lat[0]))) == 0){
+    fprintf(stderr, "bdbench: out of memory\n");
+    exit(1);
+  }
+  begin();
+  t0 = now();
+  for(long i = 0; i < n; i++){
+    int slot = -1;
+    for(int j = 0; j < NLIVE; j++){
+      if(r[i].alloc ? live[j].p == 0 : (live[j].p && live[j].tag == r[i].addr)){
+        slot = j;
+        break;
+      }
+    }
+    if(slot < 0)
+      continue;
+    if(r[i].alloc){
+      if(do_alloc(&live[slot], (uint64)LEAF << r[i].k) < 0)
+        fails++;
+      else
+        live[slot].tag = r[i].addr;
+    } else {
+      do_free(&live[slot]);
+    }
+  }
+  elapsed = now() - t0;
+  report("trace", elapsed, fails);
+  release_all();
+  free(r);
+}
+
+int
+main(int argc, char *argv[])
+{
+  long nops = 1000000;
+  char *trace = 0;
+  uint64 largest, t0;
+  int seed = 1;
+
+  arenasz = 32UL << 20;
+  for(int i = 1; i + 1 < argc; i += 2){
+    if(strcmp(argv[i], "-m") == 0)
+      arenasz = strtoul(argv[i+1], 0, 0) << 20;
+    else if(strcmp(argv[i], "-n") == 0)
+      nops = strtol(argv[i+1], 0, 0);
+    else if(strcmp(argv[i], "-s") == 0)
+      seed = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-t") == 0)
+      trace = argv[i+1];
+    else {
+      fprintf(stderr, "usage: %s [-m arena-MB] [-n ops] [-s seed] [-t tracefile]\n", argv[0]);
+      exit(1);
+    }
+  }
+  srand(seed);
+
+  if((arena = aligned_alloc(4096, arenasz)) == 0 ||
+     (lat = malloc((nops + 1) * sizeof(lat[0]))) == 0){
+    fprintf(stderr, "bdbench: out of memory\n");
+    exit(1);
+  }
+  t0 = now();
+  bd_ops.init(arena, arena + arenasz);
+  t0 = now() - t0;
+  alloc = bd_ops.malloc;
+  probe(&largest, &total0);
+  fprintf(stdout, "%s: %lu MB arena, %lu metadata bytes, init %lu us\n", bd_ops.name,
+          arenasz >> 20, arenasz - total0, t0 / 1000);
+
+  if(trace){
+    run_trace(trace);
+  } else {
+    run_random("small", size_small, NLIVE, nops);
+    run_random("page", size_page, NLIVE, nops);
+    run_random("mixed", size_mixed, NLIVE, nops);
+    run_random("huge", size_huge, 16, nops / 100);
+    run_pingpong("pingpong", 64, nops);
+    run_pingpong("pp-16k", 16384, nops);
+    if(bd_ops.malloc_trim){
+      alloc = bd_ops.malloc_trim;
+      run_random("trim", size_mixed, NLIVE, nops);
+      alloc = bd_ops.malloc;
+    }
+    if(bd_ops.realloc)
+      run_realloc(nops);
+    if(bd_ops.malloc_bulk && bd_ops.free_bulk)
+      run_bulk(nops);
+  }
+  return 0;
+}
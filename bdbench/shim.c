@@ -0,0 +1,106 @@
+// Stand-ins for the kernel services the buddy allocators use, so
+// that they can be compiled and run as ordinary Linux programs.
+// Locks are plain flags (the harness is single-threaded), and the
+// current CPU is whatever the driver last put in bdb_cpu.
+
+#include <stdarg.h>
+#include <stdlib.h>
+#define printf libc_printf
+#include <stdio.h>
+#undef printf
+
+typedef unsigned int uint;
+typedef unsigned long uint64;
+
+#include "../kernel/spinlock.h"
+
+int bdb_cpu;          // CPU the allocator believes it runs on
+int bdb_verbose;      // pass kernel printf through to stdout
+uint ticks;
+
+void
+printf(char *fmt, ...)
+{
+  va_list ap;
+
+  if(!bdb_verbose)
+    return;
+  va_start(ap, fmt);
+  vfprintf(stdout, fmt, ap);
+  va_end(ap);
+}
+
+void
+panic(char *s)
+{
+  fflush(stdout);
+  fprintf(stderr, "panic: %s\n", s);
+  abort();
+}
+
+void
+initlock(struct spinlock *lk, char *name)
+{
+  lk->name = name;
+  lk->locked = 0;
+  lk->cpu = 0;
+}
+
+void
+acquire(struct spinlock *lk)
+{
+  if(lk->locked)
+    panic("acquire");
+  lk->locked = 1;
+}
+
+void
+release(struct spinlock *lk)
+{
+  if(!lk->locked)
+    panic("release");
+  lk->locked = 0;
+}
+
+int
+holding(struct spinlock *lk)
+{
+  return lk->locked;
+}
+
+void push_off(void) { }
+void pop_off(void) { }
+
+int
+cpuid(void)
+{
+  return bdb_cpu;
+}
+
+void*
+memset(void *dst, int c, uint n)
+{
+  char *d = dst;
+
+  while(n-- > 0)
+    *d++ = c;
+  return dst;
+}
+
+void*
+memmove(void *dst, const void *src, uint n)
+{
+  const char *s = src;
+  char *d = dst;
+
+  if(s < d && s + n > d){
+    s += n;
+    d += n;
+    while(n-- > 0)
+      *--d = *--s;
+  } else {
+    while(n-- > 0)
+      *d++ = *s++;
+  }
+  return dst;
+}
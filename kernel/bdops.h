@@ -0,0 +1,26 @@
+// Operations of a buddy allocator variant.
+//
+// Each of kernel/buddy*.c defines bd_ops, and the Makefile's BUDDY
+// variable picks the one that is linked.  The kernel reaches it only
+// through the buddy_* wrappers in kalloc.c, which fall back to
+// something sensible when an optional operation is 0.  free and
+// free_sized of a null pointer do nothing.
+
+struct bdstat;
+
+struct bd_ops {
+  char *name;
+  void (*init)(void *base, void *end);
+  void *(*malloc)(uint64 nbytes);
+  void (*free)(void *p);
+  void (*free_sized)(void *p, uint64 nbytes);  // optional: free when size known
+  void *(*realloc)(void *p, uint64 nbytes);    // optional: resize, in place if possible
+  void *(*malloc_trim)(uint64 nbytes);         // optional: malloc without the rounded-up tail
+  int (*malloc_bulk)(uint64 nbytes, int n, void **out);  // optional: n blocks at once
+  void (*free_bulk)(void **p, int n);          // optional: free n blocks at once
+  uint64 (*drain)(void);                       // optional: flush cached blocks, return bytes
+  void (*stat)(struct bdstat *st);             // optional: fill in statistics
+  void (*dump)(void);                          // optional: print debug state
+};
+
+extern struct bd_ops bd_ops;
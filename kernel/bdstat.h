@@ -0,0 +1,23 @@
+// Buddy allocator statistics, returned by the bdstat system call.
+
+#define BD_MAXORDER 32   // most block sizes reported
+
+struct bdstat {
+  int norders;                 // number of block sizes
+  uint64 leafsize;             // size of the smallest block, in bytes
+  uint64 nfree[BD_MAXORDER];   // free blocks of each size
+  uint64 nalloc[BD_MAXORDER];  // allocated blocks of each size
+  uint64 inuse;                // bytes in allocated blocks
+  uint64 freebytes;            // bytes in free blocks
+  uint64 largest;              // size of the largest free block
+  uint64 fragindex;            // 0 (one free block) .. 1000 (all scattered)
+  uint64 nallocs;              // blocks taken from the buddy tree
+  uint64 nfrees;               // blocks returned to the buddy tree
+  uint64 nsplits;
+  uint64 nmerges;
+  uint64 kmempages;            // free pages, including kalloc's caches
+  uint64 nreclaimed;           // pages given back by shrinkers
+  uint64 nshrink;              // times an allocator ran dry and shrank
+  uint64 textshared;           // text pages mapped from the text cache
+  uint64 filecopied;           // file pages read into private pages
+};
@@ -4,6 +4,8 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "bdstat.h"
+#include "bdops.h"
 
 // Buddy allocator
 
@@ -13,7 +15,7 @@ static int nsizes;     // the number of entries in bd_sizes array
 #define MAXENTRY       (nsizes-1)                 // Largest index in bd_sizes array
 #define BLK_SIZE(k)   ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
 #define HEAP_SIZE     BLK_SIZE(MAXENTRY) 
-#define NBLK(k)       (1 << (MAXENTRY-k))         // Number of block at size k
+#define NBLK(k)       (1L << (MAXENTRY-(k)))      // Number of block at size k
 #define ROUNDUP(n,sz) (((((n)-1)/(sz))+1)*(sz))  // Round up to the next multiple of sz
 #define LEFT_CHILD(i)  2*(i)
 #define RIGHT_CHILD(i) (2*(i)+1)
@@ -26,11 +28,17 @@ typedef struct list Bd_list;
 // allocated, and an split array to to keep track which blocks have
 // been split.  The arrays are of type char (which is 1 byte), but the
 // allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// 8 blocks).  alloc is half that: 1 bit per pair of buddies, holding
+// the XOR of their allocated state, which is all a free needs to
+// decide whether to merge.
 struct sz_info {
-  // Bd_list free;
-  char *alloc;
+  Bd_list free;
+  char *alloc;     // per pair of buddies; see bd_flip
   char *split;
+  uint64 nfree;    // blocks on the free list
+  uint64 nalloc;   // blocks handed out at this size
+  Bd_list lazy;    // freed blocks not yet merged; see LAZY_HIGH
+  uint64 nlazy;
 };
 typedef struct sz_info Sz_info;
 
@@ -38,22 +46,127 @@ static Sz_info *bd_sizes;
 static void *bd_base;   // start address of memory managed by the buddy allocator
 static struct spinlock lock;
 
+// Allocation tracing.  Build with make BD_TRACE=1 to record every
+// block leaving or entering the tree, BD_TRACE=2 to also record splits
+// and merges.  Records go into a binary ring per CPU, overwriting the
+// oldest, and are printed by bd_trace_dump().  With BD_TRACE unset
+// the trace points compile to nothing.
+#ifndef BD_TRACE
+#define BD_TRACE 0
+#endif
+
+enum { BDT_ALLOC = 1, BDT_FREE, BDT_FAIL, BDT_SPLIT, BDT_MERGE };
+
+#if BD_TRACE > 0
+#define NTRACE 256   // records per CPU
+
+struct bd_trace {
+  uint32 ticks;
+  uint8 event;       // BDT_*
+  uint8 level;       // block size k
+  void *p;           // block address
+};
+
+static struct {
+  uint head;         // index of the next record to write
+  struct bd_trace rec[NTRACE];
+} bd_ring[NCPU];
+
+static void
+bd_trace(int event, int k, void *p)
+{
+  struct bd_trace *t;
+  int c;
+
+  push_off();
+  c = cpuid();
+  t = &bd_ring[c].rec[bd_ring[c].head++ % NTRACE];
+  t->ticks = ticks;
+  t->event = event;
+  t->level = k;
+  t->p = p;
+  pop_off();
+}
+
+// Print the trace rings, oldest record first.  For debugging.
+static void
+bd_trace_dump(void)
+{
+  static char *names[] = {
+  [BDT_ALLOC] "alloc",
+  [BDT_FREE]  "free ",
+  [BDT_FAIL]  "fail ",
+  [BDT_SPLIT] "split",
+  [BDT_MERGE] "merge",
+  };
+
+  for(int c = 0; c < NCPU; c++) {
+    uint head = bd_ring[c].head;
+    uint i = head > NTRACE ? head - NTRACE : 0;
+    for(; i < head; i++) {
+      struct bd_trace *t = &bd_ring[c].rec[i % NTRACE];
+      printf("cpu %d tick %d %s k=%d %p\n", c, t->ticks, names[t->event], t->level, t->p);
+    }
+  }
+}
+
+#define TRACE(lvl, ev, k, p) do { if(BD_TRACE >= (lvl)) bd_trace(ev, k, p); } while(0)
+#else
+#define TRACE(lvl, ev, k, p) do { } while(0)
+#endif
+
+// Cumulative counters for bd_stat, protected by lock.
+static struct {
+  uint64 nallocs;   // blocks taken from the tree
+  uint64 nfrees;    // blocks returned to the tree
+  uint64 nsplits;
+  uint64 nmerges;
+} bd_count;
+
+// Small blocks (sizes 0..MAG_MAXLEVEL, i.e. 16 bytes to 1KB) are
+// cached per CPU in magazines of recently freed blocks, so that most
+// small bd_malloc/bd_free calls are served with interrupts off and
+// without taking lock.  An empty magazine is refilled with MAG_BATCH
+// blocks from the shared tree, and a full one drains MAG_BATCH blocks
+// back, both under a single acquire of lock.  Blocks in a magazine
+// stay marked allocated in the bitmaps.
+#define MAG_MAXLEVEL  6
+#define MAG_SIZE      32   // high watermark: drain when full
+#define MAG_BATCH     16   // blocks moved per refill or drain
+
+struct magazine {
+  int n;                   // number of cached blocks
+  void *blk[MAG_SIZE];
+};
+
+static struct magazine mags[NCPU][MAG_MAXLEVEL+1];
+
+// Blocks above the magazine sizes, up to LAZY_MAXLEVEL, are freed
+// lazily: a freed block is parked on its size's lazy list, still
+// marked allocated so that its buddy does not merge with it, and the
+// next request of that size takes it back without splitting anything.
+// When a size has more than LAZY_HIGH parked blocks the oldest is
+// merged, and when an allocation finds no free block large enough
+// all parked blocks are merged before giving up.
+#define LAZY_MAXLEVEL 12   // 64KB
+#define LAZY_HIGH     16
+
 // Return 1 if bit at position index in array is set to 1
-int isset(char *array, int index) {
+int isset(char *array, long index) {
   char b = array[index/8];
   char m = (1 << (index % 8));
   return (b & m) == m;
 }
 
 // Set bit at position index in array to 1
-void set(char *array, int index) {
+void set(char *array, long index) {
   char b = array[index/8];
   char m = (1 << (index % 8));
   array[index/8] = (b | m);
 }
 
 // Clear bit at position index in array
-void unset(char *array, int index) {
+void unset(char *array, long index) {
   char b = array[index/8];
   char m = (1 << (index % 8));
   array[index/8] = (b & ~m);
@@ -73,48 +186,60 @@ get_level(uint64 n) {
   return k;
 }
 
+// Flip block bi's allocated state at size k in its pair's bit, and
+// return the new bit: 1 if the block and its buddy are now in
+// different states.  The block at MAXENTRY has no buddy.
+static int
+bd_flip(int k, long bi) {
+  if(k == MAXENTRY)
+    return 0;
+  long i = bi / 2;
+  bd_sizes[k].alloc[i/8] ^= (1 << (i % 8));
+  return isset(bd_sizes[k].alloc, i);
+}
+
 // Compute the block index for address p at size k
-int
+long
 blk_index(int k, char *p) {
-  int n = p - (char *) bd_base;
+  uint64 n = p - (char *) bd_base;
   return n / BLK_SIZE(k);
 }
 
 // Convert a block index at size k back into an address
-void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
+void *addr(int k, long bi) {
+  uint64 n = bi * BLK_SIZE(k);
   return (char *) bd_base + n;
 }
 
 
 void print_level(int level){
 
-  printf("level %d (block size %d, num of blocks %d): ", level, BLK_SIZE(level), NBLK(level));
-  unsigned alls = 0, splits = 0, frees = 0;
-  printf("Allocated blocks: ");
+  printf("level %d (block size %ld, num of blocks %ld): ", level, BLK_SIZE(level), NBLK(level));
+  uint64 splits = 0, halves = 0;
+  printf("Blocks: ");
   
-  // show which block is marked as allocated on this level
-  for (unsigned i = 0; i < NBLK(level); i++) {
+  // show which block is split on this level, and which pairs have
+  // exactly one block in use
+  for (long i = 0; i < NBLK(level); i++) {
     // print in such a manner:
     /*
     ** idx idx idx
-    **  S   A   F
+    **  S   X   .
     */
     if ((level != 0) && isset(bd_sizes[level].split, i)) {
       printf("S ");
       splits++;
     }
-    else if (isset(bd_sizes[level].alloc, i)) {
-      printf("A ");
-      alls++;
+    else if (level < MAXENTRY && isset(bd_sizes[level].alloc, i/2)) {
+      printf("X ");
+      halves++;
     }
     else {
-      printf("F ");
-      frees++;
+      printf(". ");
     }
   }
   printf("\n");
-  printf("Allocated: %d, Split: %d, Free: %d\n", alls, splits, frees);
+  printf("Split: %ld, In half-used pairs: %ld\n", splits, halves);
 }
 
 void bd_show_memory(){
@@ -127,93 +252,177 @@ void bd_show_memory(){
 }
 
 
-void set_blocks_below_as_allocated(int level, char* p){
-  if (level == 0) {
-    return;
-  }
-  int current_id = blk_index(level, p);
-  set(bd_sizes[level-1].alloc, LEFT_CHILD(current_id));
-  set(bd_sizes[level-1].alloc, RIGHT_CHILD(current_id));
-  set_blocks_below_as_allocated(level-1, addr(level-1, LEFT_CHILD(current_id)));
-  set_blocks_below_as_allocated(level-1, addr(level-1, RIGHT_CHILD(current_id)));
-}
+static void bd_coalesce(char *p, int k);
 
-void set_blocks_above_as_split(int level, char* p){
-  if (level == MAXENTRY) {
-    return;
-  }
-  int current_id = blk_index(level, p);
-  set(bd_sizes[level+1].split, PARENT(current_id));
-  set_blocks_above_as_split(level+1, addr(level+1, PARENT(current_id)));
-}
+// Merge every block parked on a lazy list.  Returns how many bytes
+// there were.  Caller must hold lock.
+static uint64
+bd_lazy_flush(void)
+{
+  uint64 n = 0;
 
-void unset_blocks_below_as_allocated(int level, char* p){
-  if (level == 0) {
-    return;
+  for(int k = MAG_MAXLEVEL+1; k <= LAZY_MAXLEVEL && k < nsizes; k++) {
+    while(bd_sizes[k].nlazy > 0) {
+      bd_coalesce(lst_pop(&bd_sizes[k].lazy), k);
+      bd_sizes[k].nlazy--;
+      n += BLK_SIZE(k);
+    }
   }
-  int current_id = blk_index(level, p);
-  unset(bd_sizes[level-1].alloc, LEFT_CHILD(current_id));
-  unset(bd_sizes[level-1].alloc, RIGHT_CHILD(current_id));
-  unset_blocks_below_as_allocated(level-1, addr(level-1, LEFT_CHILD(current_id)));
-  unset_blocks_below_as_allocated(level-1, addr(level-1, RIGHT_CHILD(current_id)));
+  return n;
 }
 
+// Allocate a block at size fk, from its lazy list if it has one, else
+// from the free lists, splitting a larger block if needed.  Caller
+// must hold lock.
+static void *
+bd_alloc_block(int fk)
+{
+  int k;
+  char *p;
+
+  if(fk < nsizes && bd_sizes[fk].nlazy > 0) {
+    p = lst_pop(&bd_sizes[fk].lazy);
+    bd_sizes[fk].nlazy--;
+    bd_sizes[fk].nalloc++;
+    bd_count.nallocs++;
+    TRACE(1, BDT_ALLOC, fk, p);
+    return p;
+  }
 
-// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
-void *
-bd_malloc(uint64 nbytes)
-{ 
-  printf("buddy system: allocating %d bytes\n", nbytes);
-  int level;
-
-  acquire(&lock);
-  printf("lock acquired\n");
+  // Find a free block >= nbytes, starting with smallest k possible;
+  // if there is none, merge the parked blocks and look again.
+  for (k = fk; k < nsizes; k++) {
+    if(!lst_empty(&bd_sizes[k].free))
+      break;
+  }
+  if(k >= nsizes && bd_lazy_flush() > 0) {
+    for (k = fk; k < nsizes; k++) {
+      if(!lst_empty(&bd_sizes[k].free))
+        break;
+    }
+  }
+  if(k >= nsizes) { // No free blocks?
+    TRACE(1, BDT_FAIL, fk, 0);
+    return 0;
+  }
 
-  // Find a free block >= nbytes, starting with smallest k possible
-  level = get_level(nbytes);
-  printf("The smallest k possible is %d\n", level);
-  unsigned id = 0;
+  // Found a block; pop it and potentially split it.
+  p = lst_pop(&bd_sizes[k].free);
+  bd_sizes[k].nfree--;
+  bd_flip(k, blk_index(k, p));
+  for(; k > fk; k--) {
+    // split a block at size k and mark one half allocated at size k-1
+    // and put the buddy on the free list at size k-1
+    char *q = p + BLK_SIZE(k-1);   // p's buddy
+    set(bd_sizes[k].split, blk_index(k, p));
+    bd_flip(k-1, blk_index(k-1, p));
+    lst_push(&bd_sizes[k-1].free, q);
+    bd_sizes[k-1].nfree++;
+    bd_count.nsplits++;
+    TRACE(2, BDT_SPLIT, k, p);
+  }
+  bd_sizes[fk].nalloc++;
+  bd_count.nallocs++;
+  TRACE(1, BDT_ALLOC, fk, p);
+  return p;
+}
 
-  if (level >= nsizes) {
-    printf("We did not find any free block\n");
-    release(&lock);
-    return 0;
-  } else if (level == 0) {
-      for (; id < NBLK(level); id++) {
-        // printf("Checking the %dth block at level %d\n", id, level);
-        if (!isset(bd_sizes[level].alloc, id)) {
-          break;
-        }
+// Allocate up to n blocks of size k into out[].  Each block taken
+// from the free lists is split all the way down into size-k blocks,
+// so a batch comes from as few blocks as possible and is mostly
+// contiguous.  Returns the number allocated.  Caller must hold lock.
+static int
+bd_alloc_bulk(int k, int n, void **out)
+{
+  int got = 0, j, m, l, i;
+  char *p, *q;
+
+  while(got < n) {
+    // j: the largest size whose size-k blocks all fit in what is
+    // left of the batch.  Take a block of size j if one is free at
+    // j or above, else the largest free block between k and j.
+    for(j = k; j < MAXENTRY && (1L << (j+1-k)) <= n - got; j++)
+      ;
+    for(m = j; m < nsizes && lst_empty(&bd_sizes[m].free); m++)
+      ;
+    if(m < nsizes) {
+      m = j;
+    } else {
+      for(m = j-1; m >= k && lst_empty(&bd_sizes[m].free); m--)
+        ;
+      if(m < k) {
+        // blocks parked on the lazy lists may merge into one.
+        if(bd_lazy_flush() > 0)
+          continue;
+        break;
       }
-  } else{
-      for (; id < NBLK(level); id++) {
-        // printf("Checking the %dth block at level %d\n", id, level);
-        if (!isset(bd_sizes[level].alloc, id) && !isset(bd_sizes[level].split, id)) {
-          break;
-        }
+    }
+    if((p = bd_alloc_block(m)) == 0)
+      break;
+
+    // both halves of every split are in use, so the pair bits below p
+    // stay clear.
+    bd_sizes[m].nalloc--;
+    for(l = m; l > k; l--) {
+      for(i = 0; i < (1 << (m-l)); i++) {
+        q = p + i * BLK_SIZE(l);
+        set(bd_sizes[l].split, blk_index(l, q));
+        bd_count.nsplits++;
+        TRACE(2, BDT_SPLIT, l, q);
       }
+    }
+    for(i = 0; i < (1 << (m-k)); i++)
+      out[got++] = p + i * BLK_SIZE(k);
+    bd_sizes[k].nalloc += 1 << (m-k);
+    bd_count.nallocs += (1 << (m-k)) - 1;   // bd_alloc_block counted one
   }
+  return got;
+}
 
-  if (id == NBLK(level)) {
-    printf("We did not find any free block\n");
+// Take a block of size k from this CPU's magazine, refilling it from
+// the tree when it is empty.
+static void *
+mag_alloc(int k)
+{
+  struct magazine *m;
+  void *p = 0;
+
+  push_off();
+  m = &mags[cpuid()][k];
+  if(m->n == 0) {
+    acquire(&lock);
+    m->n = bd_alloc_bulk(k, MAG_BATCH, m->blk);
     release(&lock);
-    return 0;
   }
+  if(m->n > 0)
+    p = m->blk[--m->n];
+  pop_off();
+  return p;
+}
 
-  printf("We found a free block at level %d\n", level);
-  char *p = addr(level, id);
-
-  printf("We found a free block at level %d, it's the %dth out of %d blocks on that level, it's %d bytes.\n", level, id, NBLK(level) ,BLK_SIZE(level));
-  set(bd_sizes[level].alloc, id);
+static uint64 bd_mag_drain(void);
 
-  // Mark all the blocks below this level as allocated
-  set_blocks_below_as_allocated(level, p);
+// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
+static void *
+bd_malloc(uint64 nbytes)
+{
+  int fk = get_level(nbytes);
+  void *p;
 
-  // Mark all the blocks above as split
-  set_blocks_above_as_split(level, p);
+  if(fk <= MAG_MAXLEVEL)
+    return mag_alloc(fk);
 
+  acquire(&lock);
+  p = bd_alloc_block(fk);
   release(&lock);
-  printf("lock released\n");
+  if(p == 0) {
+    // small blocks parked in our magazines may be what keeps a large
+    // block from merging back together.
+    bd_mag_drain();
+    acquire(&lock);
+    p = bd_alloc_block(fk);
+    release(&lock);
+  }
 
   return p;
 }
@@ -221,7 +430,7 @@ bd_malloc(uint64 nbytes)
 // Find the size of the block that p points to.
 int
 size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 0; k < MAXENTRY; k++) {
     if(isset(bd_sizes[k+1].split, blk_index(k+1, p))) { // 如果高层split了，说明这个block是k的
       return k;
     }
@@ -229,74 +438,464 @@ size(char *p) {
   return 0;
 }
 
+// Return 1 if p is the start of a block of size k: its parent at
+// size k+1 is split and p itself is not.  Two bit reads, so callers
+// that already know the size skip the walk in size().  Whether p is
+// in use is not recorded on its own, so that is up to the caller.
+static int
+is_block(int k, char *p) {
+  if((p - (char *) bd_base) % BLK_SIZE(k) != 0)
+    return 0;
+  if(k > 0 && isset(bd_sizes[k].split, blk_index(k, p)))
+    return 0;
+  if(k < MAXENTRY && !isset(bd_sizes[k+1].split, blk_index(k+1, p)))
+    return 0;
+  return 1;
+}
+
+// Merge the free block p at size k with its buddies as far up as
+// they are free, and put the result on its free list.  Only the alloc
+// and split bits along the merge path are touched, so the cost is the
+// number of merges, independent of the block size.  Caller must hold
+// lock.
+static void
+bd_coalesce(char *p, int k) {
+  void *q;
+
+  for (; k < MAXENTRY; k++) {
+    long bi = blk_index(k, p);
+
+    // Free p at size k.  In-use covers split blocks too, so if the
+    // pair bit is now clear the buddy is free as well, sitting whole
+    // on the free list at size k.
+    if (bd_flip(k, bi))  // is buddy allocated?
+      break;   // break out of loop
+
+    long buddy = (bi % 2 == 0) ? bi+1 : bi-1;
+
+    // budy is free; merge with buddy
+    q = addr(k, buddy);
+    lst_remove(q);    // remove buddy from free list
+    bd_sizes[k].nfree--;
+    bd_count.nmerges++;
+    TRACE(2, BDT_MERGE, k, q);
+    if(buddy % 2 == 0) {
+      p = q;
+    }
+    // at size k+1, mark that the merged buddy pair isn't split
+    // anymore
+    unset(bd_sizes[k+1].split, blk_index(k+1, p));
+  }
+  lst_push(&bd_sizes[k].free, p);
+  bd_sizes[k].nfree++;
+}
+
+// Free the block p at size k, merging it at once.  Caller must hold
+// lock.
+static void
+bd_free_block(char *p, int k) {
+  bd_sizes[k].nalloc--;
+  bd_count.nfrees++;
+  TRACE(1, BDT_FREE, k, p);
+  bd_coalesce(p, k);
+}
+
+// Free the block p at size k onto its lazy list, merging the oldest
+// parked block if that takes the list over LAZY_HIGH.  Caller must
+// hold lock.
+static void
+bd_lazy_free(char *p, int k) {
+  struct list *old;
+
+  bd_sizes[k].nalloc--;
+  bd_count.nfrees++;
+  TRACE(1, BDT_FREE, k, p);
+  lst_push(&bd_sizes[k].lazy, p);
+  if(++bd_sizes[k].nlazy > LAZY_HIGH) {
+    old = bd_sizes[k].lazy.prev;
+    lst_remove(old);
+    bd_sizes[k].nlazy--;
+    bd_coalesce((char *)old, k);
+  }
+}
+
+// Put a block of size k into this CPU's magazine, draining the
+// oldest MAG_BATCH blocks back to the tree when it is full.
+static void
+mag_free(char *p, int k)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &mags[cpuid()][k];
+  if(m->n == MAG_SIZE) {
+    acquire(&lock);
+    for(int i = 0; i < MAG_BATCH; i++)
+      bd_free_block(m->blk[i], k);
+    release(&lock);
+    memmove(m->blk, m->blk + MAG_BATCH, (MAG_SIZE - MAG_BATCH) * sizeof(void *));
+    m->n -= MAG_BATCH;
+  }
+  m->blk[m->n++] = p;
+  pop_off();
+}
+
+// Return every block cached in this CPU's magazines, and every block
+// parked on a lazy list, to the tree, so that they can merge again.
+// Other CPUs' magazines are left alone.  Returns the bytes returned.
+static uint64
+bd_mag_drain(void)
+{
+  struct magazine *m;
+  uint64 n = 0;
+
+  push_off();
+  acquire(&lock);
+  for(int k = 0; k <= MAG_MAXLEVEL; k++) {
+    m = &mags[cpuid()][k];
+    while(m->n > 0) {
+      bd_free_block(m->blk[--m->n], k);
+      n += BLK_SIZE(k);
+    }
+  }
+  n += bd_lazy_flush();
+  release(&lock);
+  pop_off();
+  return n;
+}
+
+// Free the block p at size k, through the magazines for small sizes
+// and the lazy lists for medium ones.
+static void
+bd_release(char *p, int k)
+{
+  if(k <= MAG_MAXLEVEL) {
+    mag_free(p, k);
+    return;
+  }
+  acquire(&lock);
+  if(k <= LAZY_MAXLEVEL)
+    bd_lazy_free(p, k);
+  else
+    bd_free_block(p, k);
+  release(&lock);
+}
+
+// Trimmed allocations.  bd_malloc_trim(nbytes) takes the block of
+// size k that holds nbytes, keeps the pieces that cover nbytes (one
+// block per bit of the rounded size, largest first) and returns the
+// rest to the free lists.  A trimmed extent is no longer a single
+// block, so it is recorded in trims[] for bd_free to find; its first
+// piece is of size k-1, at least TRIM_MINLEVEL-1, which is what lets
+// bd_free skip the table for small blocks.
+#define TRIM_MINLEVEL  (MAG_MAXLEVEL+2)   // trim requests above 1KB only
+#define NTRIM          64
+
+static struct {
+  char *p;
+  uint64 nbytes;     // rounded up to LEAF_SIZE
+} trims[NTRIM];
+static int ntrim;    // entries in use, for a lock-free "none" check
+
+// Return the index of p in trims[], or -1.  Caller must hold lock.
+static int
+trim_find(char *p)
+{
+  for(int i = 0; i < NTRIM; i++)
+    if(trims[i].p == p)
+      return i;
+  return -1;
+}
+
+// Free the pieces of trimmed extent i.  Caller must hold lock.
+static void
+trim_free(int i)
+{
+  char *p = trims[i].p;
+  uint64 need = trims[i].nbytes;
+
+  for(int k = nsizes - 1; k >= 0 && need > 0; k--) {
+    if(need >= BLK_SIZE(k)) {
+      bd_free_block(p, k);
+      p += BLK_SIZE(k);
+      need -= BLK_SIZE(k);
+    }
+  }
+  trims[i].p = 0;
+  ntrim--;
+}
+
+// If p is a trimmed extent, free all of it and return 1.
+static int
+bd_free_trimmed(char *p, int k)
+{
+  int i;
+
+  if(ntrim == 0 || k < TRIM_MINLEVEL-1)
+    return 0;
+  acquire(&lock);
+  if((i = trim_find(p)) >= 0)
+    trim_free(i);
+  release(&lock);
+  return i >= 0;
+}
+
+// Allocate nbytes, giving back the unused tail of the block that
+// holds them.  Small requests, and requests made while trims[] is
+// full, get an ordinary block.  The result is freed with bd_free.
+static void *
+bd_malloc_trim(uint64 nbytes)
+{
+  int k = get_level(nbytes), slot, j;
+  uint64 need = ROUNDUP(nbytes, LEAF_SIZE);
+  char *p, *cur;
+
+  if(k < TRIM_MINLEVEL || need == BLK_SIZE(k))
+    return bd_malloc(nbytes);
+
+  acquire(&lock);
+  if((slot = trim_find(0)) < 0 || (p = bd_alloc_block(k)) == 0) {
+    release(&lock);
+    return bd_malloc(nbytes);
+  }
+
+  // split the current block cur at size j+1 into halves at size j:
+  // keep the left half if need covers it and carry on in the right
+  // half, else free the right half and carry on in the left.
+  bd_sizes[k].nalloc--;
+  cur = p;
+  for(j = k-1; need > 0; j--) {
+    set(bd_sizes[j+1].split, blk_index(j+1, cur));
+    bd_count.nsplits++;
+    TRACE(2, BDT_SPLIT, j+1, cur);
+    if(need >= BLK_SIZE(j)) {
+      bd_sizes[j].nalloc++;
+      cur += BLK_SIZE(j);
+      need -= BLK_SIZE(j);
+    } else {
+      bd_flip(j, blk_index(j, cur + BLK_SIZE(j)));
+      lst_push(&bd_sizes[j].free, cur + BLK_SIZE(j));
+      bd_sizes[j].nfree++;
+    }
+  }
+  // cur, at size j+1, is past the end of nbytes; its buddy is the
+  // last piece kept, so it cannot merge.
+  bd_flip(j+1, blk_index(j+1, cur));
+  lst_push(&bd_sizes[j+1].free, cur);
+  bd_sizes[j+1].nfree++;
+
+  trims[slot].p = p;
+  trims[slot].nbytes = ROUNDUP(nbytes, LEAF_SIZE);
+  ntrim++;
+  release(&lock);
+  return p;
+}
+
 // Free memory pointed to by p, which was earlier allocated using
 // bd_malloc.
-void
+static void
 bd_free(void *p) {
   if (p == 0)
     return;
   else if ((uint64)p % LEAF_SIZE != 0)
     panic("bd_free: not aligned");
 
-  void *q;
-  int k;
-  printf("buddy system: freeing %p\n", p);
-  acquire(&lock);
+  // p is allocated, so the split bits size() reads above and below it
+  // cannot change under us; no need for lock here.
+  int k = size(p);
+  if(bd_free_trimmed(p, k))
+    return;
+  bd_release(p, k);
+}
 
-  unsigned level_free = size(p);
-  unsigned block_size_free = BLK_SIZE(level_free);
-  unsigned current_id = blk_index(level_free, p);
+// Free memory pointed to by p, which was earlier allocated using
+// bd_malloc(nbytes).  The size comes from the caller instead of being
+// looked up in the split bits.
+static void
+bd_free_sized(void *p, uint64 nbytes) {
+  if (p == 0)
+    return;
+  else if ((uint64)p % LEAF_SIZE != 0)
+    panic("bd_free_sized: not aligned");
 
-  printf("This is a block of %d bytes, it is the %dth block on the %dth level\n", block_size_free, current_id, level_free);
+  int k = get_level(nbytes);
+  if (k < nsizes && is_block(k, p)) {
+    bd_release(p, k);
+    return;
+  }
+  if (!bd_free_trimmed(p, k-1))
+    panic("bd_free_sized: wrong size");
+}
 
-  printf("To free this block, we begin from its level up to the max level, combining buddies if possible\n");
-  for (k = level_free; k < MAXENTRY; k++) {
-    int bi = blk_index(k, p);
-    int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
-    unset(bd_sizes[k].alloc, bi);  // free p at size k
-    printf("Freeing at level %d. Unset the alloc bit for the %dth block\n", k, bi);
+// Allocate n blocks of nbytes each into out[] with one acquire of
+// lock.  Returns the number allocated, fewer than n if memory runs
+// out.  The blocks bypass the magazines.
+static int
+bd_malloc_bulk(uint64 nbytes, int n, void **out)
+{
+  int k = get_level(nbytes), got;
 
-    if (k == 0){
-      if (isset(bd_sizes[k].alloc, buddy)) {  // is buddy allocated?
-        printf("Buddy is not free, we can't merge, freeing terminated.\n");
-        break;   // break out of loop
-      }
-    }
-    else{
-      if (isset(bd_sizes[k].alloc, buddy) || isset(bd_sizes[k].split, buddy)) {  // is buddy allocated?
-        printf("Buddy is not free, we can't merge, freeing terminated.\n");
-        break;   // break out of loop
-      }
-    }
+  if(k >= nsizes)
+    return 0;
+  acquire(&lock);
+  got = bd_alloc_bulk(k, n, out);
+  release(&lock);
+  if(got < n) {
+    bd_mag_drain();
+    acquire(&lock);
+    got += bd_alloc_bulk(k, n - got, out + got);
+    release(&lock);
+  }
+  return got;
+}
 
-    printf("Buddy is free, merge ");
-    // budy is free; merge with buddy
-    q = addr(k, buddy);
+// Free the n blocks in p[] with one acquire of lock.  They are
+// freed in address order, so buddies in the batch merge with each
+// other as soon as the second of a pair is freed; p[] is sorted in
+// place.
+static void
+bd_free_bulk(void **p, int n)
+{
+  void *t;
+  int i, j;
+
+  for(i = 1; i < n; i++) {
+    t = p[i];
+    for(j = i; j > 0 && (char*)p[j-1] > (char*)t; j--)
+      p[j] = p[j-1];
+    p[j] = t;
+  }
 
-    if(buddy % 2 == 0) {
-      printf("with right buddy\n");
-      p = q;
-    }
-    else {
-      printf("with left buddy\n");
-    }
+  acquire(&lock);
+  for(i = 0; i < n; i++) {
+    if(p[i] == 0)
+      continue;
+    if(ntrim > 0 && (j = trim_find(p[i])) >= 0)
+      trim_free(j);
+    else
+      bd_free_block(p[i], size(p[i]));
+  }
+  release(&lock);
+}
 
-    // unset all the blocks below this level as allocated, do later
-    // unset the block above as split
-    unset(bd_sizes[k+1].split, blk_index(k+1, p));
+// Shrink the allocated block p from size k to size nk < k, putting
+// the upper halves split off on the way down on the free lists.  Their
+// buddies are the part of p we keep, so none of them can merge.
+// Caller must hold lock.
+static void
+bd_shrink_block(char *p, int k, int nk)
+{
+  bd_sizes[k].nalloc--;
+  for(; k > nk; k--) {
+    set(bd_sizes[k].split, blk_index(k, p));
+    bd_flip(k-1, blk_index(k-1, p));
+    lst_push(&bd_sizes[k-1].free, p + BLK_SIZE(k-1));
+    bd_sizes[k-1].nfree++;
+    bd_count.nsplits++;
+    TRACE(2, BDT_SPLIT, k, p);
+  }
+  bd_sizes[nk].nalloc++;
+}
+
+// Grow the allocated block p from size k to size nk > k without
+// moving it, by merging in its buddy at every size on the way up.
+// That needs p to be the left half at each size and each right half
+// to be free.  Returns 0, changing nothing, if that is not the case.
+// p's side of each pair is in use (allocated, or split on the way up),
+// so its right half is free exactly when the pair bit is set.
+// Caller must hold lock.
+static int
+bd_grow_block(char *p, int k, int nk)
+{
+  int j;
+  long bi;
+
+  for(j = k; j < nk; j++) {
+    bi = blk_index(j, p);
+    if(bi % 2 != 0 || !isset(bd_sizes[j].alloc, bi/2))
+      return 0;
+  }
+  bd_sizes[k].nalloc--;
+  for(j = k; j < nk; j++) {
+    bi = blk_index(j, p);
+    bd_flip(j, bi);
+    lst_remove(addr(j, bi+1));
+    bd_sizes[j].nfree--;
+    unset(bd_sizes[j+1].split, blk_index(j+1, p));
+    bd_count.nmerges++;
+    TRACE(2, BDT_MERGE, j, addr(j, bi+1));
+  }
+  bd_sizes[nk].nalloc++;
+  return 1;
+}
 
-    printf("Unset the split bit for the %dth block at level %d\n", blk_index(k+1, p), k+1);
+// memmove n bytes, in pieces small enough for its uint length.
+static void
+bd_copy(void *dst, void *src, uint64 n)
+{
+  uint64 m;
+
+  for(; n > 0; n -= m){
+    m = n < (1L << 30) ? n : (1L << 30);
+    memmove(dst, src, m);
+    dst = (char*)dst + m;
+    src = (char*)src + m;
   }
+}
 
-  unset_blocks_below_as_allocated(k, p);
+// Resize the block p to hold nbytes.  Shrinking always happens in
+// place; growing does when the buddies above p are free, and otherwise
+// falls back to allocating a new block and copying.  Returns the
+// (possibly moved) block, or 0, leaving p alone, if there is no room.
+static void *
+bd_realloc(void *p, uint64 nbytes)
+{
+  int k, nk, i, ok;
+  void *q;
+
+  if(p == 0)
+    return bd_malloc(nbytes);
+  nk = get_level(nbytes);
+  if(nk >= nsizes)
+    return 0;
+  k = size(p);
 
+  acquire(&lock);
+  if(ntrim > 0 && (i = trim_find(p)) >= 0) {
+    // a trimmed extent is not one block; always move it.
+    uint64 n = trims[i].nbytes;
+    release(&lock);
+    if((q = bd_malloc(nbytes)) == 0)
+      return 0;
+    bd_copy(q, p, n < nbytes ? n : nbytes);
+    bd_free(p);
+    return q;
+  }
+  if(nk == k) {
+    release(&lock);
+    return p;
+  }
+  if(nk < k) {
+    bd_shrink_block(p, k, nk);
+    ok = 1;
+  } else {
+    ok = bd_grow_block(p, k, nk);
+  }
   release(&lock);
+  if(ok)
+    return p;
+
+  if((q = bd_malloc(nbytes)) == 0)
+    return 0;
+  bd_copy(q, p, BLK_SIZE(k) < nbytes ? BLK_SIZE(k) : nbytes);
+  bd_release(p, k);
+  return q;
 }
 
 // Compute the first block at size k that doesn't contain p
-int
+long
 blk_index_next(int k, char *p) {
-  int n = (p - (char *) bd_base) / BLK_SIZE(k);
+  long n = (p - (char *) bd_base) / BLK_SIZE(k);
   if((p - (char*) bd_base) % BLK_SIZE(k) != 0)
       n++;
   return n ;
@@ -312,11 +911,29 @@ log2(uint64 n) {
   return k;
 }
 
+// Set (v = 1) or clear bits [from, to) of array, a whole byte at a
+// time where possible.
+static void
+bd_setrange(char *array, long from, long to, int v)
+{
+  for(; from < to && from % 8 != 0; from++)
+    v ? set(array, from) : unset(array, from);
+  for(; to > from && to % 8 != 0; to--)
+    v ? set(array, to-1) : unset(array, to-1);
+  memset(array + from/8, v ? 0xff : 0, (to - from)/8);
+}
+
 // Mark memory from [start, stop), starting at size 0, as allocated. 
+// At each size k the blocks overlapping the range are marked split
+// with one bd_setrange.  Pairs with both blocks in the range have a
+// clear pair bit; only the pairs at either end, half in the range,
+// need their bit worked out, from whether the block outside was
+// marked by an earlier range.  So the cost is a memset per size, not
+// a bit per block.
 void
 bd_mark(void *start, void *stop)
 {
-  int bi, bj;
+  long bi, bj;
 
   if (((uint64) start % LEAF_SIZE != 0) || ((uint64) stop % LEAF_SIZE != 0))
     panic("bd_mark");
@@ -324,32 +941,83 @@ bd_mark(void *start, void *stop)
   for (int k = 0; k < nsizes; k++) {
     bi = blk_index(k, start);
     bj = blk_index_next(k, stop);
-    for(; bi < bj; bi++) {
-      if(k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        set(bd_sizes[k].split, bi);
-      }
-      set(bd_sizes[k].alloc, bi);
+    if (bi >= bj)
+      continue;
+    if (k == MAXENTRY) {
+      if (k > 0)
+        set(bd_sizes[k].split, 0);
+      break;
+    }
+    if (k == 0) {
+      // ranges do not share leaves, so the pairs inside the range
+      // are still clear and the ends just flip.
+      if (bi % 2 != 0)
+        bd_flip(0, bi);
+      if (bj % 2 != 0)
+        bd_flip(0, bj-1);
+      continue;
     }
+    int lo = bi % 2 != 0 && !isset(bd_sizes[k].split, bi-1);
+    int hi = bj % 2 != 0 && !isset(bd_sizes[k].split, bj);
+    // if a block is allocated at size k, mark it as split too.
+    bd_setrange(bd_sizes[k].split, bi, bj, 1);
+    bd_setrange(bd_sizes[k].alloc, bi/2, (bj+1)/2, 0);
+    if (lo)
+      set(bd_sizes[k].alloc, bi/2);
+    if (hi)
+      set(bd_sizes[k].alloc, bj/2);
   }
 }
 
+// If the pair holding block bi has one block allocated and one free,
+// and the free one is bi, put it on the free list at size k.
+uint64
+bd_initfree_pair(int k, long bi) {
+  uint64 free = 0;
+  if(isset(bd_sizes[k].alloc, bi/2)) {
+    free = BLK_SIZE(k);
+    bd_sizes[k].nfree++;
+    lst_push(&bd_sizes[k].free, addr(k, bi));
+  }
+  return free;
+}
+
+// Initialize the free lists for each size k.  For each size k, there
+// are only two pairs that may have a buddy that should be on free list:
+// bd_left and bd_right.  At bd_left the free block is the first one
+// past the metadata, and at bd_right the buddy of the first
+// unavailable block.
+uint64
+bd_initfree(void *bd_left, void *bd_right) {
+  uint64 free = 0;
+
+  for (int k = 0; k < MAXENTRY; k++) {   // skip max size
+    long left = blk_index_next(k, bd_left);
+    long right = blk_index(k, bd_right);
+    free += bd_initfree_pair(k, left);
+    if(right <= left || right >= NBLK(k) || right/2 == left/2)
+      continue;
+    free += bd_initfree_pair(k, right ^ 1);
+  }
+  return free;
+}
+
 // Mark the range [bd_base,p) as allocated
-int
+uint64
 bd_mark_data_structures(char *p) {
-  int meta = p - (char*)bd_base;
-  printf("bd: %d meta bytes for managing %d bytes of memory\n", meta, BLK_SIZE(MAXENTRY));
+  uint64 meta = p - (char*)bd_base;
+  printf("bd: %ld meta bytes for managing %ld bytes of memory\n", meta, BLK_SIZE(MAXENTRY));
   bd_mark(bd_base, p);
   return meta;
 }
 
 // Mark the range [end, HEAPSIZE) as allocated
-int
+uint64
 bd_mark_unavailable(void *end, void *left) {
-  int unavailable = BLK_SIZE(MAXENTRY)-(end-bd_base);
+  uint64 unavailable = BLK_SIZE(MAXENTRY)-(end-bd_base);
   if(unavailable > 0)
     unavailable = ROUNDUP(unavailable, LEAF_SIZE);
-  printf("bd: 0x%x bytes unavailable\n", unavailable);
+  printf("bd: 0x%lx bytes unavailable\n", unavailable);
 
   void *bd_end = bd_base+BLK_SIZE(MAXENTRY)-unavailable;
   bd_mark(bd_end, bd_base+BLK_SIZE(MAXENTRY));
@@ -357,10 +1025,10 @@ bd_mark_unavailable(void *end, void *left) {
 }
 
 // Initialize the buddy allocator: it manages memory from [base, end).
-void
+static void
 bd_init(void *base, void *end) {
   char *p = (char *) ROUNDUP((uint64)base, LEAF_SIZE);
-  int sz;
+  uint64 sz;
 
   initlock(&lock, "buddy");
   bd_base = (void *) p;
@@ -371,7 +1039,7 @@ bd_init(void *base, void *end) {
     nsizes++;  // round up to the next power of 2
   }
 
-  printf("bd: memory sz is %d bytes; allocate an size array of length %d\n",
+  printf("bd: memory sz is %ld bytes; allocate an size array of length %d\n",
          (char*) end - p, nsizes);
 
   // allocate bd_sizes array
@@ -379,9 +1047,12 @@ bd_init(void *base, void *end) {
   p += sizeof(Sz_info) * nsizes;
   memset(bd_sizes, 0, sizeof(Sz_info) * nsizes);
 
-  // initialize alloc array for each size k
+  // initialize free list and allocate the alloc array, 1 bit per
+  // pair of blocks, for each size k
   for (int k = 0; k < nsizes; k++) {
-    sz = sizeof(char)* ROUNDUP(NBLK(k), 8)/8;
+    lst_init(&bd_sizes[k].free);
+    lst_init(&bd_sizes[k].lazy);
+    sz = sizeof(char)* ROUNDUP(NBLK(k), 16)/16;
     bd_sizes[k].alloc = p;
     memset(bd_sizes[k].alloc, 0, sz); // set all blocks as free
     p += sz;
@@ -398,15 +1069,74 @@ bd_init(void *base, void *end) {
   p = (char *) ROUNDUP((uint64) p, LEAF_SIZE);
 
   // mark our data management part as allocated.
-  bd_mark_data_structures(p);
+  uint64 meta = bd_mark_data_structures(p);
   
   // mark the unavailable memory range [end, HEAP_SIZE) as allocated,
   // so that buddy will not hand out that memory.
-  int unavailable = bd_mark_unavailable(end, p);
+  uint64 unavailable = bd_mark_unavailable(end, p);
   void *bd_end = bd_base+BLK_SIZE(MAXENTRY)-unavailable;
   
-  printf("Actual usable memory: %d\n", (uint64)bd_end - (uint64)p);
+  // initialize free lists for each size k
+  uint64 free = bd_initfree(p, bd_end);
+  printf("Actual usable memory: %ld\n", (uint64)bd_end - (uint64)p);
+
+  // check if the amount that is free is what we expect
+  if(free != BLK_SIZE(MAXENTRY)-meta-unavailable) {
+    printf("free %ld %ld\n", free, BLK_SIZE(MAXENTRY)-meta-unavailable);
+    panic("bd_init: free mem");
+  }
 
-  print_level(10);
+}
 
+// Fill in st with a snapshot of the allocator's state.  Blocks cached
+// in the per-CPU magazines or parked on lazy lists count as free.
+static void
+bd_stat(struct bdstat *st)
+{
+  uint64 cached;
+
+  memset(st, 0, sizeof(*st));
+  acquire(&lock);
+  st->norders = nsizes < BD_MAXORDER ? nsizes : BD_MAXORDER;
+  st->leafsize = LEAF_SIZE;
+  for(int k = 0; k < st->norders; k++) {
+    cached = 0;
+    if(k <= MAG_MAXLEVEL) {
+      for(int c = 0; c < NCPU; c++)
+        cached += mags[c][k].n;
+    }
+    st->nfree[k] = bd_sizes[k].nfree + bd_sizes[k].nlazy + cached;
+    st->nalloc[k] = bd_sizes[k].nalloc - cached;
+    st->inuse += st->nalloc[k] * BLK_SIZE(k);
+    st->freebytes += st->nfree[k] * BLK_SIZE(k);
+    if(bd_sizes[k].nfree + bd_sizes[k].nlazy > 0)
+      st->largest = BLK_SIZE(k);
+  }
+  st->nallocs = bd_count.nallocs;
+  st->nfrees = bd_count.nfrees;
+  st->nsplits = bd_count.nsplits;
+  st->nmerges = bd_count.nmerges;
+  release(&lock);
+
+  // 0 when all free memory is one block, approaching 1000 as it is
+  // scattered over many small blocks.
+  if(st->freebytes > 0)
+    st->fragindex = 1000 - st->largest * 1000 / st->freebytes;
 }
+
+struct bd_ops bd_ops = {
+  .name = "buddy",
+  .init = bd_init,
+  .malloc = bd_malloc,
+  .free = bd_free,
+  .free_sized = bd_free_sized,
+  .realloc = bd_realloc,
+  .malloc_trim = bd_malloc_trim,
+  .malloc_bulk = bd_malloc_bulk,
+  .free_bulk = bd_free_bulk,
+  .drain = bd_mag_drain,
+  .stat = bd_stat,
+#if BD_TRACE > 0
+  .dump = bd_trace_dump,
+#endif
+};
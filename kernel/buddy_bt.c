@@ -4,144 +4,230 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "bdstat.h"
+#include "bdops.h"
 
 
 // buddy allocator
+//
+// The blocks form a complete binary tree stored as an array: node 1
+// is the whole heap, and node i has children 2i and 2i+1.  Each node
+// records the largest free block in its subtree, as k+1 for a block of
+// size k (0 if nothing is free), so allocation walks down from the
+// root towards a node that is free as a whole, and free walks up from
+// the leaf to the node that was handed out.  The tree costs one byte
+// per node, about an eighth of the heap, and lives at its start.
 
 
 #define LEAF_SIZE 16
-#define BLK_SIZE(level)   ((1L << (level)) * LEAF_SIZE) 
+#define BLK_SIZE(level)   ((1L << (level)) * LEAF_SIZE)
 #define ROUNDUP(n,sz) (((((n)-1)/(sz))+1)*(sz))  // Round up to the next multiple of sz
-#define IS_POWER_OF_2(n) ((n & (n - 1)) == 0)  // Check if n is power of 2
 #define MAX(a,b) ((a) > (b) ? (a) : (b))  // Return the maximum of a and b
-#define MAX_NODES ((1<<24)>>4)<<1   // Maximum number of nodes in the buddy system
 
-#define LEFT_LEAF(index)  ((index) * 2 + 1)
-#define RIGHT_LEAF(index) ((index) * 2 + 2)
-#define PARENT(index) (((index) - 1) / 2)
+#define LEFT_LEAF(index)  (2 * (index))
+#define RIGHT_LEAF(index) (2 * (index) + 1)
+#define PARENT(index) ((index) / 2)
 
-static unsigned heapsize;  // 16MB for buddy allocator
-static unsigned nodes;     // number of nodes in the buddy system
-static unsigned levels;
-static void *start;
+static int levels;       // block sizes 0 .. levels-1; the root has size levels-1
+static char *start;      // address of the first leaf
+static uchar *longest;   // largest free block in each subtree, as level+1
 
-struct buddy {
-  struct spinlock lock;
-  unsigned largest_possible_block[MAX_NODES];
-};
+static struct spinlock lock;
 
-// Convert a block index at size k back into an address
-void *addr(int level, int bi) {
-  int n = bi * BLK_SIZE(level);
-  return (char *) bd_base + n;
-}
+#define NLEAF       (1L << (levels - 1))
+#define FULL(level) ((level) + 1)   // value of a node whose block is all free
 
-// Compute the block index for address p
-int blk_index(char *p) {
-  int n = p - (char *) bd_base;
-  return n / LEAF_SIZE;
-}
+// The level of the smallest block that holds n bytes.
+static int
+fit(uint64 n)
+{
+  int k = 0;
 
-int get_level(int index) {
-    return (int) (log2(index + 1));
+  while(BLK_SIZE(k) < n)
+    k++;
+  return k;
 }
 
-int
-nearest_power_of_2(int n) {
-    while(IS_POWER_OF_2(n) == 0) {
-        n++;
-    }
-    return n;
-}
+// Recompute node i's value from its children, which are at level k-1.
+static void
+update(long i, int k)
+{
+  int l = longest[LEFT_LEAF(i)], r = longest[RIGHT_LEAF(i)];
 
-void bd_print() {
-    acquire(&bd.lock);
-    for(int i = 0; i < nodes; i++) {
-        printf("Node %d: %d\n", i, buddy.largest_possible_block[i]);
-    }
-    release(&bd.lock);
+  if(l == FULL(k-1) && r == FULL(k-1))
+    longest[i] = FULL(k);
+  else
+    longest[i] = MAX(l, r);
 }
 
-void bd_init(void *head, void* tail) {
-
-    char*p = (char*) ROUNDUP((uint64)head, LEAF_SIZE);
-    start = (void*)p;
-
-    initlock(&bd.lock, "buddy");
-
-    heapsize = (uint64)tail - (uint64)p;
-    unsigned biggest_node = ROUNDUP(heapsize, LEAF_SIZE);
-    unsigned lowest_level_nodes = nearest_power_of_2(ROUNDUP(heapsize, LEAF_SIZE)/LEAF_SIZE);
-    nodes = (lowest_level_nodes << 1) - 1;
-    
-
-    // Initialize the largest possible block for each node
-    for(int i = 0, int node_size = biggest_node; i < nodes; i++) {
-
-        buddy.largest_possible_block[i] = biggest_node;
-        if(IS_POWER_OF_2(i+1)) {
-            node_size >>= 1;
-        }
-    }
-
+static void *
+bd_malloc(uint64 nbytes)
+{
+  int k, want;
+  long i = 1;
+
+  want = fit(nbytes);
+  acquire(&lock);
+  if(want >= levels || longest[1] < FULL(want)) {
+    release(&lock);
+    return 0;
+  }
+
+  // walk down, preferring the child whose largest free block is the
+  // smaller one that still fits, so big free blocks stay whole.
+  for(k = levels - 1; k > want; k--) {
+    int l = longest[LEFT_LEAF(i)], r = longest[RIGHT_LEAF(i)];
+    if(l >= FULL(want) && (r < FULL(want) || l <= r))
+      i = LEFT_LEAF(i);
+    else
+      i = RIGHT_LEAF(i);
+  }
+  longest[i] = 0;
+
+  char *p = start + (i - (1L << (levels - 1 - want))) * BLK_SIZE(want);
+  for(; i > 1; k++) {
+    i = PARENT(i);
+    update(i, k + 1);
+  }
+  release(&lock);
+  return p;
 }
 
-int traverse(int index, int level, int target_size) {
-    int left_child = LEFT_LEAF(index);
-    int right_child = RIGHT_LEAF(index);
-    int left_size = buddy.largest_possible_block[left_child];
-    int right_size = buddy.largest_possible_block[right_child];
-
-    if(level == 0) {
-        return index;
-    }
-    if left_size == target_size {
-        return left_child;
-    }
-    if right_size == target_size {
-        return right_child;
-    }
-
-    if((left_size > target_size) && (right_size > target_size)) {
-        return (left_size < right_size) ? traverse(left_child, level - 1, target_size) : traverse(right_child, level - 1, target_size);
-    } else if (left_size > target) {
-        return traverse(left_child, level - 1, target_size);
-    } else if (right_size > target_size) {
-        return traverse(right_child, level - 1, target_size);
-    }
-
-    return -1;
+// Find the node handed out for p, and its level.  Nodes below an
+// allocated node keep the values they had while free, which are never
+// 0, so the first 0 on the way up from p's leaf is p's own node.
+static long
+node(char *p, int *kp)
+{
+  long i = NLEAF + (p - start) / LEAF_SIZE;
+  int k = 0;
+
+  while(longest[i] != 0) {
+    if(i == 1)
+      panic("bd_free: not allocated");
+    i = PARENT(i);
+    k++;
+  }
+  *kp = k;
+  return i;
 }
 
+static void
+bd_free(void *p)
+{
+  long i;
+  int k;
+
+  if(p == 0)
+    return;
+  acquire(&lock);
+  i = node(p, &k);
+  longest[i] = FULL(k);
+  for(; i > 1; k++) {
+    i = PARENT(i);
+    update(i, k + 1);
+  }
+  release(&lock);
+}
 
-void *bd_alloc(uint64 nbytes){
-
-    acquire(&bd.lock);
-
-    unsigned alloc_size = nearest_power_of_2(ROUNDUP(nbytes, LEAF_SIZE));
-
-    if(alloc_size > buddy.largest_possible_block[0]) {
-        printf("Not enough memory\n");
-        release(&bd.lock);
-        return 0;
-    }
-
-    printf("Need %d bytes, Allocating %d bytes\n", nbytes, alloc_size);
-    int index = traverse(0, levels, alloc_size);
-
-    if (index < 0){
-        printf("Error: index < 0\n");
-        release(&bd.lock);
-        return 0;
-    }
+static void
+bd_free_sized(void *p, uint64 nbytes)
+{
+  long i;
+  int k;
+
+  if(p == 0)
+    return;
+  acquire(&lock);
+  i = node(p, &k);
+  if(k != fit(nbytes))
+    panic("bd_free_sized: wrong size");
+  longest[i] = FULL(k);
+  for(; i > 1; k++) {
+    i = PARENT(i);
+    update(i, k + 1);
+  }
+  release(&lock);
+}
 
-    unsigned alloc_mem = buddy.largest_possible_block[index];
-    printf("Allocated %d bytes at index %d\n", alloc_mem, index);
-    buddy.largest_possible_block[index] = 0; // Mark the block as allocated
+int
+log2(uint64 n) {
+  int k = 0;
+  while (n > 1) {
+    k++;
+    n = n >> 1;
+  }
+  return k;
+}
 
-    int at_level = get_level(index);
+// Manage memory from [head, tail).  The tree itself and the part of
+// the top block beyond tail are left permanently allocated.
+static void
+bd_init(void *head, void* tail) {
+  char *p = (char*) ROUNDUP((uint64)head, LEAF_SIZE);
+  char *meta, *end = tail;
+  long i, first, nfree;
+
+  initlock(&lock, "buddy");
+  start = p;
+
+  levels = log2((end - p) / LEAF_SIZE) + 1;
+  if(end - p > BLK_SIZE(levels - 1))
+    levels++;
+
+  longest = (uchar*) p;
+  meta = (char*) ROUNDUP((uint64)(p + 2 * NLEAF), LEAF_SIZE);
+  printf("bd: %ld meta bytes for managing %ld bytes of memory\n", meta - p, BLK_SIZE(levels - 1));
+
+  // leaves: free if between the tree and tail.
+  first = (meta - p) / LEAF_SIZE;
+  nfree = (end - meta) / LEAF_SIZE;
+  for(i = 0; i < NLEAF; i++)
+    longest[NLEAF + i] = (i >= first && i < first + nfree) ? FULL(0) : 0;
+
+  // then each level above, from the bottom up.
+  for(int k = 1; k < levels; k++) {
+    for(i = (1L << (levels - 1 - k)); i < (1L << (levels - k)); i++)
+      update(i, k);
+  }
+}
 
+// Add the free blocks in node i's subtree, at level k, to st.
+static void
+bd_stat_node(struct bdstat *st, long i, int k)
+{
+  if(longest[i] == 0)
+    return;
+  if(longest[i] == FULL(k)) {
+    if(k < BD_MAXORDER)
+      st->nfree[k]++;
+    st->freebytes += BLK_SIZE(k);
+    return;
+  }
+  bd_stat_node(st, LEFT_LEAF(i), k - 1);
+  bd_stat_node(st, RIGHT_LEAF(i), k - 1);
+}
 
+static void
+bd_stat(struct bdstat *st)
+{
+  memset(st, 0, sizeof(*st));
+  acquire(&lock);
+  st->norders = levels < BD_MAXORDER ? levels : BD_MAXORDER;
+  st->leafsize = LEAF_SIZE;
+  bd_stat_node(st, 1, levels - 1);
+  if(longest[1] > 0)
+    st->largest = BLK_SIZE(longest[1] - 1);
+  release(&lock);
+  if(st->freebytes > 0)
+    st->fragindex = 1000 - st->largest * 1000 / st->freebytes;
+}
 
-    
-}
\ No newline at end of file
+struct bd_ops bd_ops = {
+  .name = "buddy_bt",
+  .init = bd_init,
+  .malloc = bd_malloc,
+  .free = bd_free,
+  .free_sized = bd_free_sized,
+  .stat = bd_stat,
+};
@@ -4,6 +4,8 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "bdstat.h"
+#include "bdops.h"
 
 // Buddy allocator
 
@@ -13,7 +15,7 @@ static int nsizes;     // the number of entries in bd_sizes array
 #define MAXENTRY       (nsizes-1)                 // Largest index in bd_sizes array
 #define BLK_SIZE(k)   ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
 #define HEAP_SIZE     BLK_SIZE(MAXENTRY) 
-#define NBLK(k)       (1 << (MAXENTRY-k))         // Number of block at size k
+#define NBLK(k)       (1L << (MAXENTRY-(k)))      // Number of block at size k
 #define ROUNDUP(n,sz) (((((n)-1)/(sz))+1)*(sz))  // Round up to the next multiple of sz
 
 typedef struct list Bd_list;
@@ -81,7 +83,7 @@ bd_print_vector(char *vector, int len) {
 void
 bd_print() {
   for (int k = 0; k < nsizes; k++) {
-    printf("size %d (blksz %d nblk %d): free list: ", k, BLK_SIZE(k), NBLK(k));
+    printf("size %d (blksz %ld nblk %ld): free list: ", k, BLK_SIZE(k), NBLK(k));
     lst_print(&bd_sizes[k].free);
     printf("  alloc:");
     bd_print_vector(bd_sizes[k].alloc, NBLK(k));
@@ -108,13 +110,13 @@ firstk(uint64 n) {
 // Compute the block index for address p at size k
 int
 blk_index(int k, char *p) {
-  int n = p - (char *) bd_base;
+  uint64 n = p - (char *) bd_base;
   return n / BLK_SIZE(k);
 }
 
 // Convert a block index at size k back into an address
 void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
+  uint64 n = bi * BLK_SIZE(k);
   return (char *) bd_base + n;
 }
 
@@ -129,56 +131,43 @@ void bd_show_memory(){
   // print the memory scale
   printf("bd: memory scale\n");
   for (int k = 0; k < nsizes; k++) {
-    printf("size %d (block size %d, num of blocks %d): ", k, BLK_SIZE(k), NBLK(k));
+    printf("size %d (block size %ld, num of blocks %ld): ", k, BLK_SIZE(k), NBLK(k));
     show_free_list(k);
     // show which block is marked as allocated on this level
   }
 }
 
 // allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
-void *
+static void *
 bd_malloc(uint64 nbytes)
-{ 
-  printf("buddy system: allocating %d bytes\n", nbytes);
+{
   int fk, k;
 
   acquire(&lock);
-  printf("lock acquired\n");
 
   // Find a free block >= nbytes, starting with smallest k possible
   fk = firstk(nbytes);
-  printf("The smallest k possible is %d\n", fk);
   for (k = fk; k < nsizes; k++) {
     if(!lst_empty(&bd_sizes[k].free))
       break;
   }
   if(k >= nsizes) { // No free blocks?
-    printf("We did not find any free block\n");
     release(&lock);
     return 0;
   }
-  printf("We found a free block at level %d\n", k);
+
   // Found a block; pop it and potentially split it.
   char *p = lst_pop(&bd_sizes[k].free);
-
-  printf("We found a free block at level %d, it's the %dth out of %d blocks on that level, it's %d bytes.\n", k, blk_index(k, p), NBLK(k) ,BLK_SIZE(k));
   bit_set(bd_sizes[k].alloc, blk_index(k, p));
-
   for(; k > fk; k--) {
     // split a block at size k and mark one half allocated at size k-1
     // and put the buddy on the free list at size k-1
-    printf("But the block is a little too big. Splitting it\n");
     char *q = p + BLK_SIZE(k-1);   // p's buddy
     bit_set(bd_sizes[k].split, blk_index(k, p));
     bit_set(bd_sizes[k-1].alloc, blk_index(k-1, p));
     lst_push(&bd_sizes[k-1].free, q);
-    printf("The block is split into two blocks at level %d, we take the first block (%dth out of %d blocks on that level, %d bytes)\n", k-1, blk_index(k-1, p), NBLK(k-1), BLK_SIZE(k-1));
   }
-
-  // bd_show_memory();
-
   release(&lock);
-  printf("lock released\n");
 
   return p;
 }
@@ -186,51 +175,40 @@ bd_malloc(uint64 nbytes)
 // Find the size of the block that p points to.
 int
 size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 0; k < MAXENTRY; k++) {
     if(bit_isset(bd_sizes[k+1].split, blk_index(k+1, p))) {
       return k;
     }
   }
-  return 0;
+  return MAXENTRY;
 }
 
 // Free memory pointed to by p, which was earlier allocated using
 // bd_malloc.
-void
+static void
 bd_free(void *p) {
   void *q;
   int k;
-  printf("buddy system: freeing %p\n", p);
-  acquire(&lock);
-
-  printf("This is a block of %d bytes, it is the %dth block on the %dth level\n", BLK_SIZE(size(p)), blk_index(size(p), p) ,size(p));
 
-  printf("To free this block, we begin from its level up to the max level, combining buddies if possible\n");
+  if (p == 0)
+    return;
+  acquire(&lock);
   for (k = size(p); k < MAXENTRY; k++) {
     int bi = blk_index(k, p);
     int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
     bit_clear(bd_sizes[k].alloc, bi);  // free p at size k
-    printf("Freeing at level %d. Unset the alloc bit for the %dth block\n", k, bi);
-
     if (bit_isset(bd_sizes[k].alloc, buddy)) {  // is buddy allocated?
-      printf("Buddy is allocated, we can't merge, freeing terminated.\n");
       break;   // break out of loop
     }
-    printf("Buddy is free, merge ");
     // budy is free; merge with buddy
     q = addr(k, buddy);
     lst_remove(q);    // remove buddy from free list
     if(buddy % 2 == 0) {
-      printf("with right buddy\n");
       p = q;
     }
-    else {
-      printf("with left buddy\n");
-    }
     // at size k+1, mark that the merged buddy pair isn't split
     // anymore
     bit_clear(bd_sizes[k+1].split, blk_index(k+1, p));
-    printf("Unset the split bit for the %dth block at level %d\n", blk_index(k+1, p), k+1);
   }
   lst_push(&bd_sizes[k].free, p);
   release(&lock);
@@ -281,10 +259,10 @@ bd_mark(void *start, void *stop)
 
 // If a block is marked as allocated and the buddy is free, put the
 // buddy on the free list at size k.
-int
+uint64
 bd_initfree_pair(int k, int bi) {
   int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
-  int free = 0;
+  uint64 free = 0;
   if(bit_isset(bd_sizes[k].alloc, bi) !=  bit_isset(bd_sizes[k].alloc, buddy)) {
     // one of the pair is free
     free = BLK_SIZE(k);
@@ -299,20 +277,20 @@ bd_initfree_pair(int k, int bi) {
 // Initialize the free lists for each size k.  For each size k, there
 // are only two pairs that may have a buddy that should be on free list:
 // bd_left and bd_right.
-int
+uint64
 bd_initfree(void *bd_left, void *bd_right) {
-  int free = 0;
+  uint64 free = 0;
 
   for (int k = 0; k < MAXENTRY; k++) {   // skip max size
 
     int left = blk_index_next(k, bd_left);
     int right = blk_index(k, bd_right);
-    int free_left =0, free_right = 0;
+    uint64 free_left =0, free_right = 0;
 
     free_left = bd_initfree_pair(k, left); // the very start of the data memory
     // printf("free level k = %d, left block freed: %d\n", k, free_left);
     free += free_left;
-    if(right <= left)
+    if(right <= left || right >= NBLK(k))
       continue;
     free_right = bd_initfree_pair(k, right); // the very end of the data memory
     // printf("free level k = %d, right block freed: %d\n", k, free_right);
@@ -322,21 +300,21 @@ bd_initfree(void *bd_left, void *bd_right) {
 }
 
 // Mark the range [bd_base,p) as allocated
-int
+uint64
 bd_mark_data_structures(char *p) {
-  int meta = p - (char*)bd_base;
-  printf("bd: %d meta bytes for managing %d bytes of memory\n", meta, BLK_SIZE(MAXENTRY));
+  uint64 meta = p - (char*)bd_base;
+  printf("bd: %ld meta bytes for managing %ld bytes of memory\n", meta, BLK_SIZE(MAXENTRY));
   bd_mark(bd_base, p);
   return meta;
 }
 
 // Mark the range [end, HEAPSIZE) as allocated
-int
+uint64
 bd_mark_unavailable(void *end, void *left) {
-  int unavailable = BLK_SIZE(MAXENTRY)-(end-bd_base);
+  uint64 unavailable = BLK_SIZE(MAXENTRY)-(end-bd_base);
   if(unavailable > 0)
     unavailable = ROUNDUP(unavailable, LEAF_SIZE);
-  printf("bd: 0x%x bytes unavailable\n", unavailable);
+  printf("bd: 0x%lx bytes unavailable\n", unavailable);
 
   void *bd_end = bd_base+BLK_SIZE(MAXENTRY)-unavailable;
   bd_mark(bd_end, bd_base+BLK_SIZE(MAXENTRY));
@@ -344,10 +322,10 @@ bd_mark_unavailable(void *end, void *left) {
 }
 
 // Initialize the buddy allocator: it manages memory from [base, end).
-void
+static void
 bd_init(void *base, void *end) {
   char *p = (char *) ROUNDUP((uint64)base, LEAF_SIZE);
-  int sz;
+  uint64 sz;
 
   initlock(&lock, "buddy");
   bd_base = (void *) p;
@@ -358,7 +336,7 @@ bd_init(void *base, void *end) {
     nsizes++;  // round up to the next power of 2
   }
 
-  printf("bd: memory sz is %d bytes; allocate an size array of length %d\n",
+  printf("bd: memory sz is %ld bytes; allocate an size array of length %d\n",
          (char*) end - p, nsizes);
 
   // allocate bd_sizes array
@@ -387,31 +365,54 @@ bd_init(void *base, void *end) {
 
   // done allocating; mark the memory range [base, p) as allocated, so
   // that buddy will not hand out that memory.
-  // int meta = 
-  bd_mark_data_structures(p);
+  uint64 meta = bd_mark_data_structures(p);
   
   // mark the unavailable memory range [end, HEAP_SIZE) as allocated,
   // so that buddy will not hand out that memory.
-  int unavailable = bd_mark_unavailable(end, p);
+  uint64 unavailable = bd_mark_unavailable(end, p);
   void *bd_end = bd_base+BLK_SIZE(MAXENTRY)-unavailable;
   
   // initialize free lists for each size k
-  printf("Init free lists with addr %p and end %p\n", p, bd_end);
-  // int free = bd_initfree(p, bd_end);
-  bd_initfree(p, bd_end);
-  printf("Actual usable memory: %d\n", (uint64)bd_end - (uint64)p);
-
-  // print all free lists
-  bd_show_memory();
-  
+  uint64 free = bd_initfree(p, bd_end);
 
   // check if the amount that is free is what we expect
-  // if(free != BLK_SIZE(MAXENTRY)-meta-unavailable) {
-  //   printf("free %d %d\n", free, BLK_SIZE(MAXENTRY)-meta-unavailable);
-  //   panic("bd_init: free mem");
-  // }
+  if(free != BLK_SIZE(MAXENTRY)-meta-unavailable) {
+    printf("free %ld %ld\n", free, BLK_SIZE(MAXENTRY)-meta-unavailable);
+    panic("bd_init: free mem");
+  }
 }
 
+// Fill in st from the free lists.  This variant keeps no per-size
+// allocation counts, so only the free side is reported.
+static void
+bd_stat(struct bdstat *st)
+{
+  struct list *l;
+
+  memset(st, 0, sizeof(*st));
+  acquire(&lock);
+  st->norders = nsizes < BD_MAXORDER ? nsizes : BD_MAXORDER;
+  st->leafsize = LEAF_SIZE;
+  for(int k = 0; k < st->norders; k++) {
+    for(l = bd_sizes[k].free.next; l != &bd_sizes[k].free; l = l->next)
+      st->nfree[k]++;
+    st->freebytes += st->nfree[k] * BLK_SIZE(k);
+    if(st->nfree[k] > 0)
+      st->largest = BLK_SIZE(k);
+  }
+  release(&lock);
+  if(st->freebytes > 0)
+    st->fragindex = 1000 - st->largest * 1000 / st->freebytes;
+}
+
+struct bd_ops bd_ops = {
+  .name = "buddy_c",
+  .init = bd_init,
+  .malloc = bd_malloc,
+  .free = bd_free,
+  .stat = bd_stat,
+};
+
 
 
 
@@ -4,6 +4,8 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "bdstat.h"
+#include "bdops.h"
 
 // Buddy system
 
@@ -17,9 +19,9 @@ static int nsizes; // 有多少种块大小。 最大是 nsizes - 1
 */
 
 #define LEAF_SIZE 16 // 最小的块大小
-#define BLK_SIZE(k) ((uint64)1 << (k))*LEAF_SIZE // 第k种块的大小
-#define MAX_ENTRY nsizes-1 // 最大的entry数量
-#define NBLK(k) (1<<(MAX_ENTRY-k)) // 第k种块的数量
+#define BLK_SIZE(k) (((uint64)1 << (k))*LEAF_SIZE) // 第k种块的大小
+#define MAX_ENTRY (nsizes-1) // 最大的entry数量
+#define NBLK(k) (1L<<(MAX_ENTRY-(k))) // 第k种块的数量
 #define ROUNDUP(n,sz) (((((n)-1)/(sz))+1)*(sz))  // round到sz的下一个倍数
 
 typedef struct list list_t;
@@ -66,16 +68,16 @@ int find_a_size(uint64 n){
 
 
 int get_block_index_from_addr(int k, char *p){
-    int offset = p - (char *)start;
+    uint64 offset = p - (char *)start;
     return offset / BLK_SIZE(k);
 }
 
 void* get_addr_from_block_index(int k, int i){
-    return (char *)start + i * BLK_SIZE(k);
+    return (char *)start + (uint64)i * BLK_SIZE(k);
 }
 
 
-void* bd_malloc(uint64 num_bytes){
+static void* bd_malloc(uint64 num_bytes){
     acquire(&lock);
     // 底层都是blocks，buddy只是提供了不同的视图管理这些blocks
 
@@ -122,16 +124,16 @@ int get_block_size(char *p){
 
     // we check from the smallest block size
     // if the higher level block is split, this means the current block size is being used
-    for(int k = 0; k < nsizes; k++){
+    for(int k = 0; k < MAX_ENTRY; k++){
         if(isset(size_infos[k+1].split, get_block_index_from_addr(k+1, p))){
             return k;
         }
     }
-    return 0;
+    return MAX_ENTRY;
 }
 
 // free memory pointed to by p, and combine the buddy blocks if possible
-void bd_free(void *p){
+static void bd_free(void *p){
 
     // if p == 0, return
     if (p == 0){
@@ -185,7 +187,7 @@ log2(uint64 n) {
 }
 
 int get_following_block(int k, char *meta_data_end){
-    int n = (meta_data_end - (char *)start) / BLK_SIZE(k);
+    int n = (uint64)(meta_data_end - (char *)start) / BLK_SIZE(k);
     if((meta_data_end - (char *)start) % BLK_SIZE(k) != 0){
         n++;
     }
@@ -194,9 +196,9 @@ int get_following_block(int k, char *meta_data_end){
 
 // if a block is allocated but its buddy is free, put the buddy on the free list
 // return the size of the block
-int check_and_add_buddy(int k, int i){
-    int buddy_id = (i % 2 == 0) ? i + 1 : i - 1, free = 0;
-    printf("check_and_add_buddy: %d\n", isset(size_infos[k].allocated, i));
+uint64 check_and_add_buddy(int k, int i){
+    int buddy_id = (i % 2 == 0) ? i + 1 : i - 1;
+    uint64 free = 0;
     // if one of them is allocated and the other is free, add the free one to the free list
     if(isset(size_infos[k].allocated, i) != isset(size_infos[k].allocated, buddy_id)){
         free = BLK_SIZE(k);
@@ -229,18 +231,15 @@ void mark_as_allocated(void* head, void* tail){
     
 }
 
-int
+uint64
 bd_initfree(void *bd_left, void *bd_right) {
-  int free = 0;
-  printf("bd_initfree: bd_left: %p, bd_right: %p\n", bd_left, bd_right);
+  uint64 free = 0;
   for (int k = 0; k < MAX_ENTRY; k++) {   // skip max size
     int left = get_following_block(k, bd_left);
-    printf("bd_initfree: k: %d, left: %d\n", k, left);
     int right = get_block_index_from_addr(k, bd_right);
-    printf("bd_initfree: k: %d, right: %d\n", k, right);
     free += check_and_add_buddy(k, left);
-    printf("bd_initfree: free: %d\n", free);
-    if(right <= left)
+    // right == NBLK(k) when the memory ends exactly at the top block
+    if(right <= left || right >= NBLK(k))
       continue;
     free += check_and_add_buddy(k, right);
   }
@@ -248,9 +247,8 @@ bd_initfree(void *bd_left, void *bd_right) {
 }
 
 
-void bd_init(void* base, void* end){
+static void bd_init(void* base, void* end){
     // Round up base
-    printf("bd_init: base: %p, end: %p\n", base, end);
     char* base_start = (char *)ROUNDUP((uint64)base, LEAF_SIZE);
 
     initlock(&lock, "buddy");
@@ -272,7 +270,7 @@ void bd_init(void* base, void* end){
         // allocate the alloc array for size k
         size_infos[k].allocated = p;
         // calculate the size of the alloc array
-        int alloc_size = sizeof(char) * (ROUNDUP(NBLK(k), 8))/8;
+        uint64 alloc_size = sizeof(char) * (ROUNDUP(NBLK(k), 8))/8;
         memset(size_infos[k].allocated, 0, alloc_size);
         p += alloc_size;
     }
@@ -280,7 +278,7 @@ void bd_init(void* base, void* end){
     // init the split array
     for(int k = 0; k < nsizes; k++){
         size_infos[k].split = p;
-        int split_size = sizeof(char) * (ROUNDUP(NBLK(k), 8))/8;
+        uint64 split_size = sizeof(char) * (ROUNDUP(NBLK(k), 8))/8;
         memset(size_infos[k].split, 0, split_size);
         p += split_size;
     }
@@ -289,40 +287,51 @@ void bd_init(void* base, void* end){
     p = (char *)ROUNDUP((uint64)p, LEAF_SIZE);
 
     // mark our management meta data as allocated
-    int meta_data_size = (char*)p - base_start;
-    printf("Meta data inited. meta_data_size: %d\n", meta_data_size);
-    
+    uint64 meta_data_size = (char*)p - base_start;
     mark_as_allocated(base_start, p);
-    printf("Marked meta data as allocated\n");
+    printf("bd: %ld meta bytes for managing %ld bytes of memory\n", meta_data_size, BLK_SIZE(MAX_ENTRY));
 
     // 我们还多虚分配了好多内存，nsizes实际偏大，需要把它们设为不可分配
-    int non_exist_size = BLK(MAX_ENTRY) - (end-start);
+    void *bd_end = base_start + BLK_SIZE(MAX_ENTRY);
+    uint64 non_exist_size = BLK_SIZE(MAX_ENTRY) - ((char*)end - base_start);
     if(non_exist_size > 0){
         non_exist_size = ROUNDUP(non_exist_size, LEAF_SIZE);
-        printf("Non exist size: %d\n", non_exist_size);
-        void *bd_end = base_start + BLK_SIZE(MAX_ENTRY) - non_exist_size;
+        bd_end = base_start + BLK_SIZE(MAX_ENTRY) - non_exist_size;
         mark_as_allocated(bd_end, base_start + BLK_SIZE(MAX_ENTRY));
+    } else {
+        non_exist_size = 0;
     }
-    else{
-        printf("No non exist size\n");
-        void* bd_end = base_start + BLK_SIZE(MAX_ENTRY);
-    }
+
     // init free lists for each block size
-    int free_size = 0;
-    
-    // for(int k = 0; k < MAX_ENTRY; k++){
-    //     int left = get_following_block(k, p);
-    //     int right = get_block_index_from_addr(k, bd_end);
-
-    //     free_size += check_and_add_buddy(k, left);
-    //     if(right <= left) continue;
-    //     free_size += check_and_add_buddy(k, right);
-    // }
-    free_size = bd_initfree(p, bd_end);
-    printf("Free size: %d\n", free_size);
-
-    if (free_size != BLK_SIZE(MAX_ENTRY) - meta_data_size){
+    uint64 free_size = bd_initfree(p, bd_end);
+    if (free_size != BLK_SIZE(MAX_ENTRY) - meta_data_size - non_exist_size){
         panic("buddy system init error");
     }
+}
 
-}
\ No newline at end of file
+// Fill in st from the free lists; per-size allocation counts are not
+// kept by this allocator.
+static void bd_stat(struct bdstat *st){
+    memset(st, 0, sizeof(*st));
+    acquire(&lock);
+    st->norders = nsizes < BD_MAXORDER ? nsizes : BD_MAXORDER;
+    st->leafsize = LEAF_SIZE;
+    for(int k = 0; k < st->norders; k++){
+        for(list_t *l = size_infos[k].free_list.next; l != &size_infos[k].free_list; l = l->next)
+            st->nfree[k]++;
+        st->freebytes += st->nfree[k] * BLK_SIZE(k);
+        if(st->nfree[k] > 0)
+            st->largest = BLK_SIZE(k);
+    }
+    release(&lock);
+    if(st->freebytes > 0)
+        st->fragindex = 1000 - st->largest * 1000 / st->freebytes;
+}
+
+struct bd_ops bd_ops = {
+    .name = "buddy_my",
+    .init = bd_init,
+    .malloc = bd_malloc,
+    .free = bd_free,
+    .stat = bd_stat,
+};
@@ -1,13 +1,17 @@
+struct bdstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct shrinker;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -60,11 +64,26 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzero_refill(void);
 void            kfree(void *);
+void            kdup(void *);
+int             kshared(void *);
 void            kinit();
-void            buddy_init(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
+uint64          kcachedpages(void);
+uint64          kfreepages(void);
 void            buddy_free(void*);
+void            buddy_free_sized(void*, uint64);
 void*           buddy_alloc(uint64);
+void*           buddy_alloc_trim(uint64);
+int             buddy_alloc_bulk(uint64, int, void**);
+void            buddy_free_bulk(void**, int);
+void*           buddy_realloc(void*, uint64, uint64);
+uint64          buddy_drain(void);
+void            buddy_stat(struct bdstat*);
+void            buddy_dump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -74,11 +93,23 @@ void            end_op(int);
 void            crash_op(int,int);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
 
+// shrinker.c
+void            shrinker_register(struct shrinker*);
+uint64          shrink(uint64);
+void            shrinkstat(uint64*, uint64*);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
@@ -167,7 +198,9 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmfault(pagetable_t, uint64, int, int);
+uint64          uvmdirty(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -175,6 +208,10 @@ uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+void*           vmalloc(uint64);
+void            vfree(void*);
+void            kvmflush(void);
+void            vmalloc_selftest(void);
 
 // plic.c
 void            plicinit(void);
@@ -183,6 +220,22 @@ uint64          plic_pending(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+void            vmainit(void);
+void            textfree(uint64);
+void            textinval(struct inode*);
+void            vmastat(uint64*, uint64*);
+struct vma*     vma_add(struct vma*, uint64, uint64, struct inode*, uint, uint, int, int);
+struct vma*     vma_find(struct proc*, uint64);
+int             vma_fault(pagetable_t, struct vma*, uint64);
+void            vma_mapcached(pagetable_t, struct vma*);
+void            vma_prefault(uint64, uint64);
+uint64          vma_map(struct proc*, uint64, struct inode*, uint, uint, int, int);
+int             vma_unmap(struct proc*, uint64, uint64);
+int             vma_fillshared(struct proc*);
+int             vma_dup(struct proc*, struct proc*);
+void            vma_free(pagetable_t, struct vma*);
+
 // virtio_disk.c
 void            virtio_disk_init(int);
 void            virtio_disk_rw(int, struct buf *, int);
@@ -194,11 +247,6 @@ void            virtio_disk_intr(int);
 // Extra files for allocator lab
 
 
-// buddy.c
-void           bd_init(void*,void*);
-void           bd_free(void*);
-void           *bd_malloc(uint64);
-
 struct list {
   struct list *next;
   struct list *prev;
@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "syscall.h"
+#include "bdstat.h"
 
 uint64
 sys_demo(void)
@@ -37,8 +38,11 @@ sys_demo(void)
   printf("p1: %p\n", p1);
   char* p2 = buddy_alloc(4*1024*1024);
   printf("p2: %p\n", p2);
-  buddy_free(p1);
-  buddy_free(p2);
+  if(p1)
+    buddy_free_sized(p1, 4*1024*1024);
+  if(p2)
+    buddy_free_sized(p2, 4*1024*1024);
+  buddy_dump();
 
   // printf("alloc 1\n\n");
   // char* p1 = buddy_alloc(8);
@@ -83,4 +87,48 @@ sys_demo(void)
   
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Run n rounds of small buddy allocations and frees (16 bytes to
+// 1KB) in the kernel, for measuring the allocator from user space.
+// Returns 0, or -1 if an allocation failed.
+uint64
+sys_bdtest(void)
+{
+  int n;
+  void *p[7];
+
+  if(argint(0, &n) < 0)
+    return -1;
+  for(int i = 0; i < n; i++){
+    for(int j = 0; j < NELEM(p); j++){
+      if((p[j] = buddy_alloc(16 << j)) == 0){
+        while(--j >= 0)
+          buddy_free(p[j]);
+        return -1;
+      }
+    }
+    for(int j = 0; j < NELEM(p); j++)
+      buddy_free(p[j]);
+  }
+  return 0;
+}
+
+// Copy a snapshot of the buddy allocator's statistics to user
+// address addr.
+uint64
+sys_bdstat(void)
+{
+  uint64 addr;
+  struct bdstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  buddy_stat(&st);
+  st.kmempages = st.freebytes / PGSIZE + kcachedpages();
+  shrinkstat(&st.nreclaimed, &st.nshrink);
+  vmastat(&st.textshared, &st.filecopied);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -4,11 +4,12 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
 int
 exec(char *path, char **argv)
 {
@@ -18,9 +19,14 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma *vma, *v;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // the regions are too big for the kernel stack; stage them in p.
+  vma = p->execvma;
+  memset(vma, 0, sizeof(p->execvma));
+
   begin_op(ROOTDEV);
 
   if((ip = namei(path)) == 0){
@@ -38,7 +44,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each segment comes from; its pages are read in
+  // when the program first touches them (see vma.c).
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -49,12 +56,24 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz > PHYSTOP - KERNBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      v = vma_add(vma, ph.vaddr, PGROUNDUP(ph.vaddr + ph.memsz), ip, ph.off, ph.filesz,
+                  PTE_R|PTE_W|PTE_X, 0);
+    else
+      v = vma_add(vma, ph.vaddr, PGROUNDUP(ph.vaddr + ph.memsz), ip, ph.off, ph.filesz,
+                  PTE_R|PTE_X, VMA_TEXT);
+    if(v == 0)
       goto bad;
+    if(v->flags & VMA_TEXT)
+      vma_mapcached(pagetable, v);
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op(ROOTDEV);
@@ -111,43 +130,19 @@ exec(char *path, char **argv)
   p->sz = sz;
   p->tf->epc = elf.entry;  // initial program counter = main
   p->tf->sp = sp; // initial stack pointer
+  vma_free(oldpagetable, p->vma);
   proc_freepagetable(oldpagetable, oldsz);
+  memmove(p->vma, vma, sizeof(p->vma));
+  memset(vma, 0, sizeof(p->execvma));
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
   if(ip){
     iunlockput(ip);
     end_op(ROOTDEV);
   }
+  vma_free(pagetable, vma);
+  if(pagetable)
+    proc_freepagetable(pagetable, sz);
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -20,6 +20,7 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint gen;           // bumped whenever the contents change (vma.c)
 
   short type;         // copy of disk inode
   short major;
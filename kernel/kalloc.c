@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or power-of-two runs of contiguous pages.
 
 #include "types.h"
 #include "param.h"
@@ -8,16 +9,27 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "bdstat.h"
+#include "bdops.h"
+#include "shrinker.h"
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
-
-
-void freerange(void *pa_start, void *pa_end);
-
-extern char end[]; // first address after kernel.
-                   // defined by kernel.ld.
+// All of physical memory from end to PHYSTOP is managed by the buddy
+// allocator; a page is simply a buddy block of PGSIZE bytes, so page
+// and sub-page allocations draw from the same pool.  Which buddy
+// allocator is chosen at build time (BUDDY in the Makefile); it is
+// reached through bd_ops by the buddy_* wrappers at the end of this
+// file.
+//
+// In front of the buddy allocator each CPU keeps its own list of free
+// pages under its own lock, so kalloc/kfree on different harts do not
+// contend.  An empty list is refilled with KMEM_BATCH pages from the
+// buddy allocator; once that runs dry, half of a sibling CPU's list is
+// stolen.  A list longer than KMEM_HIGH gives KMEM_BATCH pages back.
+#define KMEM_BATCH  32
+#define KMEM_HIGH   128
 
 struct run {
   struct run *next;
@@ -26,45 +38,256 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kmem[NCPU];
+
+// Pages that fork shares copy-on-write have a count of the extra
+// references to them: a page is freed by the kfree that finds its
+// count at 0, so pages that are never shared need no bookkeeping.
+static int pgref[(PHYSTOP - KERNBASE) / PGSIZE];
+
+#define PGREF(pa) (&pgref[((uint64)(pa) - KERNBASE) / PGSIZE])
+
+// Pages zeroed ahead of time by idle CPUs, for kalloc_zeroed().
+#define KZERO_MAX    64
+#define KZERO_BATCH  8
+
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} kzero;
+
+static void *
+kzero_take(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if(r){
+    kzero.list = r->next;
+    kzero.n--;
+    r->next = 0;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+static void buddy_selftest(void);
+static uint64 kmem_scan(uint64);
+static uint64 buddy_scan(uint64);
+
+static struct shrinker kmem_shrinker = { "kmem", kmem_scan };
+static struct shrinker buddy_shrinker = { "buddy", buddy_scan };
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP-8*1024*1024);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  bd_ops.init((void*)PGROUNDUP((uint64)end), (void*)PHYSTOP);
+  buddy_selftest();
+  shrinker_register(&kmem_shrinker);
+  shrinker_register(&buddy_shrinker);
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Give up to n pages from the front of list to the buddy allocator,
+// KMEM_BATCH at a time.
+static void
+kmem_release(struct run *r, int n)
+{
+  void *pg[KMEM_BATCH];
+  int i;
+
+  while(r && n > 0){
+    for(i = 0; r && n > 0 && i < KMEM_BATCH; i++, n--){
+      pg[i] = r;
+      r = r->next;
+    }
+    buddy_free_bulk(pg, i);
+  }
+}
+
+// Move up to n pages off the front of CPU id's list.
+// Caller must hold kmem[id].lock.
+static struct run *
+kmem_take(int id, int n, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = kmem[id].freelist;
+  if(head == 0 || n == 0){
+    *got = 0;
+    return 0;
+  }
+  for(r = head, i = 1; i < n && r->next; i++)
+    r = r->next;
+  kmem[id].freelist = r->next;
+  kmem[id].nfree -= i;
+  r->next = 0;
+  *got = i;
+  return head;
+}
+
+// Return CPU id's free pages to the buddy allocator so that they
+// can merge into larger blocks again.  Returns how many there were.
+static int
+kmem_drain(int id)
+{
+  struct run *r;
+  int n;
+
+  acquire(&kmem[id].lock);
+  r = kmem_take(id, kmem[id].nfree, &n);
+  release(&kmem[id].lock);
+  kmem_release(r, n);
+  return n;
+}
+
+// Shrinker: give the pages on every CPU's list, then the zero pool,
+// back to the buddy allocator, where they can serve any size.
+static uint64
+kmem_scan(uint64 want)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct run *r;
+  uint64 got = 0;
+  int n;
+
+  for(int i = 0; i < NCPU && got < want; i++)
+    got += kmem_drain(i);
+  if(got < want){
+    acquire(&kzero.lock);
+    r = kzero.list;
+    n = kzero.n;
+    kzero.list = 0;
+    kzero.n = 0;
+    release(&kzero.lock);
+    kmem_release(r, n);
+    got += n;
+  }
+  return got;
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *extra = 0;
+  int id, n = 0;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // drop one reference to a shared page.
+  for(int c = *PGREF(pa); c > 0; c = *PGREF(pa))
+    if(__sync_bool_compare_and_swap(PGREF(pa), c, c - 1))
+      return;
+
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > KMEM_HIGH)
+    extra = kmem_take(id, KMEM_BATCH, &n);
+  release(&kmem[id].lock);
+  pop_off();
+
+  kmem_release(extra, n);
+}
+
+// Take another reference to page pa, which the next kfree of it
+// will drop instead of freeing the page.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  __sync_fetch_and_add(PGREF(pa), 1);
+}
+
+// Does anyone besides the caller hold a reference to page pa?
+int
+kshared(void *pa)
+{
+  return __atomic_load_n(PGREF(pa), __ATOMIC_ACQUIRE) > 0;
+}
+
+// Refill CPU id's empty list, from the buddy allocator if it has
+// pages, otherwise by stealing half of another CPU's list.
+// Returns one page for the caller, or 0 if memory is exhausted.
+static struct run *
+kmem_refill(int id)
+{
+  struct run *r, *head = 0, *tail = 0;
+  void *pg[KMEM_BATCH];
+  int i, n;
+
+  n = buddy_alloc_bulk(PGSIZE, KMEM_BATCH, pg);
+  for(i = n - 1; i >= 0; i--){
+    r = pg[i];
+    r->next = head;
+    if(head == 0)
+      tail = r;
+    head = r;
+  }
+
+  for(i = 0; n == 0 && i < NCPU; i++){
+    if(i == id)
+      continue;
+    acquire(&kmem[i].lock);
+    head = kmem_take(i, (kmem[i].nfree + 1) / 2, &n);
+    release(&kmem[i].lock);
+    for(tail = head; tail && tail->next; tail = tail->next)
+      ;
+  }
+
+  if(head == 0)
+    return 0;
+  r = head;
+  if(n > 1){
+    acquire(&kmem[id].lock);
+    tail->next = kmem[id].freelist;
+    kmem[id].freelist = head->next;
+    kmem[id].nfree += n - 1;
+    release(&kmem[id].lock);
+  }
+  return r;
+}
+
+// Take a page from this CPU's list, refilling it if empty.
+static struct run *
+kmem_alloc(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  if(r == 0)
+    r = kmem_refill(id);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -75,38 +298,383 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  // the zero pool, then the shrinkers, are the last resort before
+  // running out.
+  if((r = kmem_alloc()) == 0)
+    r = kzero_take();
+  if(r == 0 && shrink(1) > 0)
+    r = kmem_alloc();
 
+#ifdef KALLOC_JUNK
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
 
+// Allocate one zeroed page, from the pre-zeroed pool if possible.
+void *
+kalloc_zeroed(void)
+{
+  char *r;
+
+  if((r = (char*)kzero_take()) != 0)
+    return r;
+  if((r = kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return r;
+}
+
+// Zero up to KZERO_BATCH pages into the pool.  Called by idle CPUs
+// from scheduler(); returns the number of pages added, so the caller
+// can look for runnable processes again before sleeping.
+int
+kzero_refill(void)
+{
+  struct run *r;
+  int n;
+
+  for(n = 0; n < KZERO_BATCH && kzero.n < KZERO_MAX; n++){
+    if((r = kmem_alloc()) == 0)
+      break;
+    memset(r, 0, PGSIZE);
+    acquire(&kzero.lock);
+    r->next = kzero.list;
+    kzero.list = r;
+    kzero.n++;
+    release(&kzero.lock);
+  }
+  return n;
+}
+
+// Number of free pages held by kalloc itself, on the per-CPU lists
+// and in the zero pool, rather than by the buddy allocator.
+uint64
+kcachedpages(void)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    n += kmem[i].nfree;
+    release(&kmem[i].lock);
+  }
+  acquire(&kzero.lock);
+  n += kzero.n;
+  release(&kzero.lock);
+  return n;
+}
 
+// Free pages, in the buddy allocator and in kalloc's own caches.
+// Cheap enough for sbrk to check against on every call.
+uint64
+kfreepages(void)
+{
+  struct bdstat st;
 
+  if(bd_ops.stat == 0)
+    return (PHYSTOP - KERNBASE) / PGSIZE;   // can't tell; don't refuse
+  buddy_stat(&st);
+  return st.freebytes / PGSIZE + kcachedpages();
+}
 
+// Allocate 2^order physically contiguous pages.  The run is aligned
+// to its size relative to the start of the buddy heap, which is only
+// page-aligned, so callers may count on page alignment alone.
+// Returns 0 if no such run is free.
+void *
+kalloc_pages(int order)
+{
+  char *r;
 
+  // buddy_alloc shrinks the caches, our free lists among them, if
+  // no run is free.
+  r = buddy_alloc((uint64)PGSIZE << order);
+#ifdef KALLOC_JUNK
+  if(r)
+    memset(r, 5, PGSIZE << order); // fill with junk
+#endif
+  return (void*)r;
+}
 
-/*buddy*/
+// Free 2^order pages allocated with kalloc_pages(order).
 void
-buddy_init() // buddy的初始化函数
+kfree_pages(void *pa, int order)
 {
-  bd_init((void*)(PHYSTOP-8*1024*1024), (void*)PHYSTOP);
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_pages");
+
+#ifdef KALLOC_JUNK
+  memset(pa, 1, PGSIZE << order);
+#endif
+  buddy_free_sized(pa, (uint64)PGSIZE << order);
 }
 
 
+
+/*buddy*/
 void
 buddy_free(void *pa)
 {
-  bd_free(pa);
+  bd_ops.free(pa);
+}
+
+// Free a block when the caller still knows the size it asked for;
+// lets allocators that can skip the size lookup do so.
+void
+buddy_free_sized(void *pa, uint64 nbytes)
+{
+  if(bd_ops.free_sized)
+    bd_ops.free_sized(pa, nbytes);
+  else
+    bd_ops.free(pa);
 }
 
+// Allocate nbytes; if nothing is free, ask the shrinkers for the
+// pages and try once more.
 void *
 buddy_alloc(uint64 nbytes)
 {
-  return bd_malloc(nbytes);
+  void *p;
+
+  if((p = bd_ops.malloc(nbytes)) == 0 && shrink(PGROUNDUP(nbytes) / PGSIZE) > 0)
+    p = bd_ops.malloc(nbytes);
+  return p;
+}
+
+// Allocate n blocks of nbytes each into out[], in one trip to the
+// allocator when it supports that.  Returns how many were allocated;
+// fewer than n when memory runs low.
+int
+buddy_alloc_bulk(uint64 nbytes, int n, void **out)
+{
+  int i;
+
+  if(bd_ops.malloc_bulk)
+    return bd_ops.malloc_bulk(nbytes, n, out);
+  for(i = 0; i < n; i++)
+    if((out[i] = bd_ops.malloc(nbytes)) == 0)
+      break;
+  return i;
+}
+
+// Free the n blocks in pa[], which may be reordered.
+void
+buddy_free_bulk(void **pa, int n)
+{
+  if(bd_ops.free_bulk){
+    bd_ops.free_bulk(pa, n);
+    return;
+  }
+  for(int i = 0; i < n; i++)
+    bd_ops.free(pa[i]);
+}
+
+// Allocate nbytes, letting the allocator give back the part of the
+// power-of-two block beyond nbytes.  Free the result with buddy_free
+// or buddy_free_sized(pa, nbytes).
+void *
+buddy_alloc_trim(uint64 nbytes)
+{
+  if(bd_ops.malloc_trim)
+    return bd_ops.malloc_trim(nbytes);
+  return bd_ops.malloc(nbytes);
+}
+
+// Resize pa, allocated with at least oldsize bytes, to nbytes.  The
+// allocator grows or shrinks the block in place when it can; oldsize
+// is only needed to copy when it cannot resize at all.  Returns the
+// new block, or 0 with pa untouched.
+void *
+buddy_realloc(void *pa, uint64 oldsize, uint64 nbytes)
+{
+  uint64 n, m;
+  void *q;
+
+  if(bd_ops.realloc)
+    return bd_ops.realloc(pa, nbytes);
+  if((q = bd_ops.malloc(nbytes)) == 0)
+    return 0;
+  if(pa){
+    // memmove's length is a uint; copy in pieces that fit.
+    n = oldsize < nbytes ? oldsize : nbytes;
+    for(uint64 off = 0; off < n; off += m){
+      m = n - off < (1L << 30) ? n - off : (1L << 30);
+      memmove((char*)q + off, (char*)pa + off, m);
+    }
+    buddy_free(pa);
+  }
+  return q;
+}
+
+// Give blocks the allocator caches privately back to its free pool.
+// Returns how many bytes that was.
+uint64
+buddy_drain(void)
+{
+  if(bd_ops.drain)
+    return bd_ops.drain();
+  return 0;
+}
+
+// Shrinker: merge what the buddy allocator keeps parked, kmem's
+// pages among it once kmem_scan has run, back into its free pool.
+// Any bytes at all count as a page, so that the caller retries.
+static uint64
+buddy_scan(uint64 want)
+{
+  return (buddy_drain() + PGSIZE - 1) / PGSIZE;
+}
+
+void
+buddy_stat(struct bdstat *st)
+{
+  if(bd_ops.stat)
+    bd_ops.stat(st);
+  else
+    memset(st, 0, sizeof(*st));
+}
+
+void
+buddy_dump(void)
+{
+  if(bd_ops.dump)
+    bd_ops.dump();
+}
+
+// Check the allocator chosen at build time against the contract the
+// rest of the kernel relies on: blocks from 16 bytes to 64KB are
+// distinct, aligned to their size up to a page, keep their contents
+// when resized, are freeable with or without their size, singly or
+// in bulk, ignore null frees, serve small blocks out of pages freed
+// after memory ran out, and coalesce again once all are freed,
+// trimmed extents included.  kalloc_pages runs of 1 to 2^BDTEST_ORDER
+// pages must be page-aligned, disjoint, and return every byte when
+// freed.
+#define BDTEST_N 64
+#define BDTEST_ORDER 6
+
+static void
+buddy_selftest(void)
+{
+  static char *p[BDTEST_N];
+  struct bdstat st0, st;
+  uint64 big, sz, align;
+  char *q, *pg, *sm;
+
+  // the largest block available at boot.
+  for(big = PHYSTOP - KERNBASE; big >= PGSIZE; big >>= 1){
+    if((q = buddy_alloc(big)) != 0)
+      break;
+  }
+  if(big < PGSIZE)
+    panic("buddy_selftest: no memory");
+  buddy_free(q);
+  buddy_free(0);
+  buddy_free_sized(0, PGSIZE);
+
+  for(int i = 0; i < BDTEST_N; i++){
+    sz = 16L << (i % 13);
+    align = sz < PGSIZE ? sz : PGSIZE;
+    if((p[i] = buddy_alloc(sz)) == 0)
+      panic("buddy_selftest: alloc");
+    if((uint64)p[i] % align)
+      panic("buddy_selftest: alignment");
+    memset(p[i], i, sz);
+  }
+  for(int i = 0; i < BDTEST_N; i += 5){
+    // grow to twice the size, then shrink back.
+    sz = 16L << (i % 13);
+    if((q = buddy_realloc(p[i], sz, 2*sz)) == 0)
+      panic("buddy_selftest: realloc");
+    memset(q + sz, i, sz);
+    if((p[i] = buddy_realloc(q, 2*sz, sz)) == 0)
+      panic("buddy_selftest: realloc");
+  }
+  // an odd size, trimmed, in the middle of everything else.
+  if((q = buddy_alloc_trim(5*PGSIZE + 16)) == 0)
+    panic("buddy_selftest: trim");
+  memset(q, 0xff, 5*PGSIZE + 16);
+  for(int i = 0; i < BDTEST_N; i++){
+    sz = 16L << (i % 13);
+    for(uint64 j = 0; j < sz; j++)
+      if(p[i][j] != i)
+        panic("buddy_selftest: overlap");
+    if(i % 2)
+      buddy_free_sized(p[i], sz);
+    else
+      buddy_free(p[i]);
+  }
+  buddy_free_sized(q, 5*PGSIZE + 16);
+
+  // a batch of pages in one call.
+  if(buddy_alloc_bulk(PGSIZE, BDTEST_N, (void**)p) != BDTEST_N)
+    panic("buddy_selftest: bulk");
+  for(int i = 0; i < BDTEST_N; i++){
+    if((uint64)p[i] % PGSIZE)
+      panic("buddy_selftest: bulk alignment");
+    memset(p[i], i, PGSIZE);
+  }
+  for(int i = 0; i < BDTEST_N; i++)
+    if(p[i][0] != i || p[i][PGSIZE-1] != i)
+      panic("buddy_selftest: bulk overlap");
+  buddy_free_bulk((void**)p, BDTEST_N);
+
+  // use up memory with pages, then with the smallest blocks; a small
+  // allocation must then find room in pages freed since, wherever
+  // the allocator parked them.
+  pg = sm = 0;
+  while((q = buddy_alloc(PGSIZE)) != 0){
+    *(char**)q = pg;
+    pg = q;
+  }
+  while((q = buddy_alloc(16)) != 0){
+    *(char**)q = sm;
+    sm = q;
+  }
+  for(int i = 0; i < 10 && pg; i++){
+    q = pg;
+    pg = *(char**)q;
+    buddy_free_sized(q, PGSIZE);
+  }
+  if((q = buddy_alloc(16)) == 0)
+    panic("buddy_selftest: small alloc after frees");
+  buddy_free_sized(q, 16);
+  while((q = sm) != 0){
+    sm = *(char**)q;
+    buddy_free_sized(q, 16);
+  }
+  while((q = pg) != 0){
+    pg = *(char**)q;
+    buddy_free_sized(q, PGSIZE);
+  }
+
+  // page runs of each order at once, through kalloc's own interface;
+  // free memory must come back to where it started.
+  buddy_drain();
+  buddy_stat(&st0);
+  for(int k = 0; k <= BDTEST_ORDER; k++){
+    sz = (uint64)PGSIZE << k;
+    if((p[k] = kalloc_pages(k)) == 0)
+      panic("buddy_selftest: kalloc_pages");
+    if((uint64)p[k] % PGSIZE)
+      panic("buddy_selftest: kalloc_pages alignment");
+    memset(p[k], k, sz);
+  }
+  for(int k = 0; k <= BDTEST_ORDER; k++){
+    sz = (uint64)PGSIZE << k;
+    for(uint64 j = 0; j < sz; j += PGSIZE/4)
+      if(p[k][j] != k)
+        panic("buddy_selftest: kalloc_pages overlap");
+    kfree_pages(p[k], k);
+  }
+  buddy_drain();
+  buddy_stat(&st);
+  if(st.freebytes != st0.freebytes)
+    panic("buddy_selftest: kalloc_pages leak");
+
+  if((q = buddy_alloc(big)) == 0)
+    panic("buddy_selftest: coalesce");
+  buddy_free(q);
+  printf("buddy: %s self-test ok\n", bd_ops.name);
 }
@@ -15,15 +15,20 @@ void
 main()
 {
   if(cpuid() == 0){
+    uint64 t0, t1;
+
+    t0 = *(uint64*)CLINT_MTIME;
     consoleinit();
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
-    kinit();         // physical page allocator
-    buddy_init();    // buddy allocator
+    kinit();         // physical page allocator (buddy)
+    t1 = *(uint64*)CLINT_MTIME;
+    slabinit();      // kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    vmalloc_selftest(); // check vmalloc and address reuse
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -32,8 +37,13 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    vmainit();       // text page cache
+    pipeinit();      // pipe cache
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
     userinit();      // first user process
+    // qemu's CLINT timer runs at 10MHz.
+    printf("boot: kinit %ld us, userinit %ld us after reset\n",
+           (t1 - t0) / 10, *(uint64*)CLINT_MTIME / 10);
     __sync_synchronize();
     started = 1;
   } else {
@@ -45,8 +45,13 @@
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
+// MEMSZ is the size of that RAM in MB; the Makefile passes it to
+// both the kernel and qemu -m.
+#ifndef MEMSZ
+#define MEMSZ 128
+#endif
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
+#define PHYSTOP (KERNBASE + MEMSZ*1024L*1024)
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -56,6 +61,11 @@
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// vmalloc maps its areas into this window of kernel virtual
+// addresses, well above PHYSTOP and below the kernel stacks.
+#define VMALLOC_BASE (1L << 37)
+#define VMALLOC_SIZE (1L << 30)
+
 // User memory layout.
 // Address zero first:
 //   text
@@ -63,6 +73,9 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
-//   TRAPFRAME (p->tf, used by the trampoline)
+//   mmap regions, placed from MMAPTOP down
+//   guard page
+//   TRAPFRAME (page holding p->tf, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define MMAPTOP (TRAPFRAME - PGSIZE)
@@ -26,11 +26,11 @@ static struct {
 static char digits[] = "0123456789abcdef";
 
 static void
-printint(int xx, int base, int sign)
+printint(long xx, int base, int sign)
 {
-  char buf[16];
+  char buf[24];
   int i;
-  uint x;
+  uint64 x;
 
   if(sign && (sign = xx < 0))
     x = -xx;
@@ -59,7 +59,7 @@ printptr(uint64 x)
     consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the console. only understands %d, %x, %p, %s.
+// Print to the console. only understands %d, %x, %ld, %lx, %p, %s.
 void
 printf(char *fmt, ...)
 {
@@ -90,6 +90,20 @@ printf(char *fmt, ...)
     case 'x':
       printint(va_arg(ap, int), 16, 1);
       break;
+    case 'l':
+      c = fmt[++i] & 0xff;
+      if(c == 'd'){
+        printint(va_arg(ap, long), 10, 1);
+        break;
+      } else if(c == 'x'){
+        printint(va_arg(ap, long), 16, 0);
+        break;
+      }
+      // Print unknown % sequence to draw attention.
+      consputc('%');
+      consputc('l');
+      i--;
+      break;
     case 'p':
       printptr(va_arg(ap, uint64));
       break;
@@ -23,12 +23,18 @@ static void wakeup1(struct proc *chan);
 
 extern char trampoline[]; // trampoline.S
 
+// Trapframes come from a slab cache, several to a page.  A slab is
+// one page, so a trapframe never straddles a page boundary, and the
+// page holding it is what gets mapped at TRAPFRAME.
+static struct kmem_cache *tfcache;
+
 void
 procinit(void)
 {
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  tfcache = kmem_cache_create("trapframe", sizeof(struct trapframe), 0, 0);
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -108,8 +114,8 @@ allocproc(void)
 found:
   p->pid = allocpid();
 
-  // Allocate a trapframe page.
-  if((p->tf = (struct trapframe *)kalloc()) == 0){
+  // Allocate a trapframe.
+  if((p->tf = (struct trapframe *)kmem_cache_alloc(tfcache)) == 0){
     release(&p->lock);
     return 0;
   }
@@ -150,7 +156,7 @@ static void
 freeproc(struct proc *p)
 {
   if(p->tf)
-    kfree((void*)p->tf);
+    kmem_cache_free(tfcache, p->tf);
   p->tf = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
@@ -182,9 +188,10 @@ proc_pagetable(struct proc *p)
   mappages(pagetable, TRAMPOLINE, PGSIZE,
            (uint64)trampoline, PTE_R | PTE_X);
 
-  // map the trapframe just below TRAMPOLINE, for trampoline.S.
+  // map the page holding the trapframe just below TRAMPOLINE,
+  // for trampoline.S.
   mappages(pagetable, TRAPFRAME, PGSIZE,
-           (uint64)(p->tf), PTE_R | PTE_W);
+           PGROUNDDOWN((uint64)(p->tf)), PTE_R | PTE_W);
 
   return pagetable;
 }
@@ -243,14 +250,19 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // only reserve the addresses; uvmfault allocates each page
+    // when it is first touched.  Still refuse, as sbrk always has,
+    // to grow by more than is free right now; memory that runs out
+    // later, before the pages are touched, kills the process then.
+    if(sz + n > PHYSTOP - KERNBASE ||
+       (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE > kfreepages())
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == 0) {
       return -1;
@@ -269,18 +281,30 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // the child maps the same pages of shared regions, so they must
+  // all be there; filling them may sleep, so do it before allocproc.
+  if(vma_fillshared(p) < 0)
+    return -1;
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child.  Set np->sz before
+  // copying the regions, so that freeproc frees the pages below it
+  // if that fails.
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(vma_dup(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   np->parent = p;
 
@@ -361,6 +385,8 @@ exit(int status)
   end_op(ROOTDEV);
   p->cwd = 0;
 
+  vma_free(p->pagetable, p->vma);
+
   acquire(&p->parent->lock);
 
   acquire(&p->lock);
@@ -452,6 +478,7 @@ scheduler(void)
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
+    kvmflush();
 
     int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
@@ -472,7 +499,8 @@ scheduler(void)
       }
       release(&p->lock);
     }
-    if(found == 0){
+    if(found == 0 && kzero_refill() == 0){
+      // nothing to run and the zero pool is full.
       intr_on();
       asm volatile("wfi");
     }
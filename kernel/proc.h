@@ -24,6 +24,7 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 vmgen;               // vfree generation as of our last TLB flush.
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +81,24 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A page-aligned region [start, end) of a process's memory whose
+// pages are filled in when first touched: filesz bytes from offset
+// off of ip, then zeros, or all zeros if ip is 0.  end is 0 if the
+// slot is unused.
+struct vma {
+  uint64 start;
+  uint64 end;
+  struct inode *ip;
+  uint off;
+  uint filesz;
+  int perm;           // PTE_R, PTE_W, PTE_X for its pages
+  int flags;
+  uint gen;           // ip->gen when the region was made
+};
+
+#define VMA_TEXT    1   // read-only, pages shared through the text cache
+#define VMA_SHARED  2   // mmap MAP_SHARED: written back to the file
+
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -102,5 +121,8 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Regions filled in from files
+  struct vma execvma[NVMA];    // exec builds the new image's regions here
   char name[16];               // Process name (debugging)
+  int nsleeplock;              // Sleep-locks held
 };
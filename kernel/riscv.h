@@ -332,6 +332,9 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_D (1L << 7) // dirty; qemu sets it on a store
+#define PTE_COW (1L << 8) // copy-on-write; a software (RSW) bit
+#define PTE_TEXT (1L << 9) // page from the text cache; also RSW
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
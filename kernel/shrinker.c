@@ -0,0 +1,60 @@
+// Shrinker registry.
+//
+// Caches that keep free memory for themselves register a shrinker
+// at boot.  When kalloc or the buddy allocator comes up empty, the
+// slow path calls shrink(), which asks each shrinker in turn to give
+// pages back, and then retries once before reporting failure.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "shrinker.h"
+
+#define NSHRINKER 8
+
+// Shrinkers are only registered while booting, on one CPU, so the
+// table needs no lock; the counters are updated atomically.
+static struct shrinker *shrinkers[NSHRINKER];
+static int nshrinker;
+static uint64 nshrink;     // calls to shrink()
+static uint64 nreclaimed;  // pages reclaimed by all shrinkers
+
+void
+shrinker_register(struct shrinker *s)
+{
+  if(nshrinker == NSHRINKER)
+    panic("shrinker_register");
+  s->nreclaimed = 0;
+  shrinkers[nshrinker++] = s;
+}
+
+// Ask the shrinkers, in the order they registered, to free memory
+// until at least npages pages have come back.  Must not be called
+// with a lock held that a shrinker takes.  Returns the number of
+// pages reclaimed.
+uint64
+shrink(uint64 npages)
+{
+  uint64 got = 0, n;
+
+  __sync_fetch_and_add(&nshrink, 1);
+  for(int i = 0; i < nshrinker && got < npages; i++){
+    n = shrinkers[i]->scan(npages - got);
+    __sync_fetch_and_add(&shrinkers[i]->nreclaimed, n);
+    got += n;
+  }
+  __sync_fetch_and_add(&nreclaimed, got);
+  return got;
+}
+
+// Pages reclaimed by shrinkers since boot, and how many times the
+// allocators had to ask.
+void
+shrinkstat(uint64 *pages, uint64 *calls)
+{
+  *pages = __atomic_load_n(&nreclaimed, __ATOMIC_RELAXED);
+  *calls = __atomic_load_n(&nshrink, __ATOMIC_RELAXED);
+}
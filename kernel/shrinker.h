@@ -0,0 +1,8 @@
+// A cache that holds free memory it can give back when the page
+// allocators run dry.  scan(n) frees up to about n pages and returns
+// how many it freed.
+struct shrinker {
+  char *name;
+  uint64 (*scan)(uint64);
+  uint64 nreclaimed;      // pages given back by scan so far
+};
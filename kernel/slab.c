@@ -0,0 +1,272 @@
+// Slab allocator for fixed-size kernel objects.
+//
+// A cache hands out objects of one size, carved from SLAB_SIZE
+// blocks of the buddy allocator.  Each slab starts with a struct slab
+// header followed by as many objects as fit; the header of an object's
+// slab is found by rounding the object's address down to SLAB_SIZE.
+//
+// Every CPU has an active slab per cache, from which it allocates and
+// to which it frees with interrupts off and without the cache lock.
+// Frees from other CPUs to an active slab are parked on the slab's
+// remote list under the cache lock and reclaimed by the owner when its
+// local free list runs out.  Slabs that are not active sit on the
+// cache's partial or full list, protected by the cache lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "shrinker.h"
+
+#define SLAB_SIZE   PGSIZE
+#define SLAB_ALIGN  16     // minimum object alignment
+#define SLAB_KEEP   2      // empty slabs kept per cache before freeing
+#define NCACHE      16
+
+struct slab {
+  struct list link;          // on cache partial or full list
+  struct kmem_cache *cache;
+  void *freelist;            // free objects, linked through their first word
+  void *remote;              // objects freed by other CPUs while active
+  int nremote;               // number of objects on remote
+  int inuse;                 // objects handed out
+  int cpu;                   // CPU that has this slab active, or -1
+};
+
+struct kmem_cache {
+  char *name;
+  uint objsize;              // object size, rounded up to the alignment
+  uint off;                  // offset of the first object in a slab
+  int nobj;                  // objects per slab
+  void (*ctor)(void*);       // run once on each object of a new slab
+  struct spinlock lock;
+  struct list partial;       // inactive slabs with free objects
+  struct list full;          // inactive slabs with no free objects
+  int npartial;
+  struct slab *active[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} caches;
+
+static struct slab*
+slabof(void *obj)
+{
+  return (struct slab*)((uint64)obj & ~((uint64)SLAB_SIZE - 1));
+}
+
+// Create a cache of objects of the given size.  align must be a power
+// of two; 0 means SLAB_ALIGN.  ctor, if non-zero, is called on each
+// object when its slab is first carved, not on every allocation.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, uint align, void (*ctor)(void*))
+{
+  struct kmem_cache *c;
+
+  if(align < SLAB_ALIGN)
+    align = SLAB_ALIGN;
+  if(size < sizeof(void*))
+    size = sizeof(void*);
+
+  acquire(&caches.lock);
+  if(caches.n == NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &caches.cache[caches.n++];
+  release(&caches.lock);
+
+  c->name = name;
+  c->objsize = (size + align - 1) & ~(align - 1);
+  c->off = (sizeof(struct slab) + align - 1) & ~(align - 1);
+  c->nobj = (SLAB_SIZE - c->off) / c->objsize;
+  if(c->nobj == 0)
+    panic("kmem_cache_create: object too large");
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  lst_init(&c->partial);
+  lst_init(&c->full);
+  c->npartial = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->active[i] = 0;
+  return c;
+}
+
+// Carve a new slab for cache c from the buddy allocator.
+static struct slab*
+slab_new(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = buddy_alloc(SLAB_SIZE)) == 0)
+    return 0;
+  if((uint64)s % SLAB_SIZE)
+    panic("slab_new: misaligned");
+  s->cache = c;
+  s->freelist = 0;
+  s->remote = 0;
+  s->nremote = 0;
+  s->inuse = 0;
+  s->cpu = -1;
+  for(int i = c->nobj - 1; i >= 0; i--){
+    obj = (char*)s + c->off + i * c->objsize;
+    if(c->ctor)
+      c->ctor(obj);
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  return s;
+}
+
+static void*
+slab_pop(struct slab *s)
+{
+  void *obj = s->freelist;
+  s->freelist = *(void**)obj;
+  s->inuse++;
+  return obj;
+}
+
+// Allocate an object from cache c.
+// Returns 0 if no memory is available.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+  int id;
+
+  push_off();
+  id = cpuid();
+  s = c->active[id];
+  if(s && s->freelist){
+    obj = slab_pop(s);
+    pop_off();
+    return obj;
+  }
+
+  acquire(&c->lock);
+  if(s){
+    if(s->remote){
+      // take back what other CPUs freed to our slab.
+      s->freelist = s->remote;
+      s->inuse -= s->nremote;
+      s->remote = 0;
+      s->nremote = 0;
+    } else {
+      // s is full; retire it.
+      s->cpu = -1;
+      lst_push(&c->full, s);
+      c->active[id] = s = 0;
+    }
+  }
+  if(s == 0){
+    if(!lst_empty(&c->partial)){
+      s = lst_pop(&c->partial);
+      c->npartial--;
+    } else {
+      release(&c->lock);
+      s = slab_new(c);
+      acquire(&c->lock);
+      if(s == 0){
+        release(&c->lock);
+        pop_off();
+        return 0;
+      }
+    }
+    s->cpu = id;
+    c->active[id] = s;
+  }
+  obj = slab_pop(s);
+  release(&c->lock);
+  pop_off();
+  return obj;
+}
+
+// Return obj, allocated from cache c, to its slab.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = slabof(obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  if(s->cpu == cpuid()){
+    // our own active slab; only this CPU touches its free list.
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    pop_off();
+    return;
+  }
+
+  acquire(&c->lock);
+  if(s->cpu >= 0){
+    // active on another CPU.
+    *(void**)obj = s->remote;
+    s->remote = obj;
+    s->nremote++;
+  } else {
+    int wasfull = s->inuse == c->nobj;
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    if(wasfull){
+      lst_remove(&s->link);
+      lst_push(&c->partial, s);
+      c->npartial++;
+    }
+    if(s->inuse == 0 && c->npartial > SLAB_KEEP){
+      lst_remove(&s->link);
+      c->npartial--;
+      buddy_free_sized(s, SLAB_SIZE);
+    }
+  }
+  release(&c->lock);
+  pop_off();
+}
+
+// Shrinker: free the empty slabs that caches keep on their partial
+// lists (up to SLAB_KEEP each).
+static uint64
+slab_scan(uint64 want)
+{
+  struct kmem_cache *c;
+  struct slab *s, *next;
+  uint64 got = 0;
+  int n;
+
+  acquire(&caches.lock);
+  n = caches.n;
+  release(&caches.lock);
+  for(int i = 0; i < n && got < want; i++){
+    c = &caches.cache[i];
+    acquire(&c->lock);
+    for(s = (struct slab*)c->partial.next; s != (struct slab*)&c->partial; s = next){
+      next = (struct slab*)s->link.next;
+      if(s->inuse == 0){
+        lst_remove(&s->link);
+        c->npartial--;
+        buddy_free_sized(s, SLAB_SIZE);
+        got++;
+      }
+    }
+    release(&c->lock);
+  }
+  return got;
+}
+
+static struct shrinker slab_shrinker = { "slab", slab_scan };
+
+void
+slabinit(void)
+{
+  initlock(&caches.lock, "caches");
+  shrinker_register(&slab_shrinker);
+}
@@ -27,6 +27,7 @@ acquiresleep(struct sleeplock *lk)
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  myproc()->nsleeplock++;
   release(&lk->lk);
 }
 
@@ -36,6 +37,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  myproc()->nsleeplock--;
   wakeup(lk);
   release(&lk->lk);
 }
@@ -109,6 +109,10 @@ extern uint64 sys_ntas(void);
 extern uint64 sys_crash(void);
 extern uint64 sys_getprocs(void);
 extern uint64 sys_demo(void);
+extern uint64 sys_bdtest(void);
+extern uint64 sys_bdstat(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -136,6 +140,10 @@ static uint64 (*syscalls[])(void) = {
 [SYS_crash]   sys_crash,
 [SYS_getprocs]   sys_getprocs,
 [SYS_demo]  sys_demo,
+[SYS_bdtest]  sys_bdtest,
+[SYS_bdstat]  sys_bdstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
 };
 
 void
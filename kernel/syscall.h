@@ -27,4 +27,8 @@
 #define SYS_mount  24
 #define SYS_umount 25
 #define SYS_getprocs 26
-#define SYS_demo   27
\ No newline at end of file
+#define SYS_demo   27
+#define SYS_bdtest 28
+#define SYS_bdstat 29
+#define SYS_mmap   30
+#define SYS_munmap 31
\ No newline at end of file
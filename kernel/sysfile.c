@@ -75,6 +75,9 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  // the copy into p is made with the inode or pipe locked.
+  if(n > 0)
+    vma_prefault(p, n);
   return fileread(f, p, n);
 }
 
@@ -87,6 +90,9 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  // the copy from p is made with the inode or pipe locked.
+  if(n > 0)
+    vma_prefault(p, n);
 
   return filewrite(f, p, n);
 }
@@ -495,3 +501,59 @@ sys_crash(void)
   crash_op(ip->dev, crash);
   return 0;
 }
+
+// Map length bytes of fd from offset, or of zeros with
+// MAP_ANONYMOUS, somewhere in the caller's address space; addr is
+// only a hint, and ignored.
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off, perm = 0;
+  struct file *f = 0;
+  struct inode *ip = 0;
+  uint filesz = 0;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  // exactly one of MAP_SHARED and MAP_PRIVATE.
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ip = f->ip;
+    ilock(ip);
+    if(ip->size > off)
+      filesz = ip->size - off < len ? ip->size - off : len;
+    iunlock(ip);
+  }
+
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;   // risc-v has no write-only pages
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  return vma_map(myproc(), len, ip, off, filesz, perm, (flags & MAP_SHARED) ? VMA_SHARED : 0);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  return vma_unmap(myproc(), addr, len);
+}
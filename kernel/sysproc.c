@@ -35,6 +35,9 @@ sys_wait(void)
   uint64 p;
   if(argaddr(0, &p) < 0)
     return -1;
+  // wait copies out the status with locks held.
+  if(p != 0)
+    vma_prefault(p, sizeof(int));
   return wait(p);
 }
 
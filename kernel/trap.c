@@ -65,6 +65,13 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 && uvmfault(p->pagetable, r_stval(), PTE_X, 1) == 0){
+    // instruction page fault on a page not filled in yet.
+  } else if(r_scause() == 13 && uvmfault(p->pagetable, r_stval(), PTE_R, 1) == 0){
+    // load page fault on a page not filled in yet.
+  } else if(r_scause() == 15 && uvmfault(p->pagetable, r_stval(), PTE_W, 1) == 0){
+    // store page fault on a page not filled in yet or a
+    // copy-on-write page; it is there, and writable, now.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -123,8 +130,10 @@ usertrapret(void)
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
+  // p->tf need not start its page, so pass its address
+  // within the TRAPFRAME mapping.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(TRAPFRAME + (uint64)p->tf % PGSIZE, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
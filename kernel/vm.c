@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +13,27 @@
  */
 pagetable_t kernel_pagetable;
 
+// vmalloc areas: runs of pages from kalloc, mapped at consecutive
+// addresses in [VMALLOC_BASE, VMALLOC_BASE+VMALLOC_SIZE) of
+// kernel_pagetable, each followed by an unmapped guard page.
+//
+// Other harts may still hold TLB entries for an area after vfree,
+// and xv6 has no way to flush them remotely.  So vfree bumps gen and
+// stamps the area with it; each hart's scheduler loop flushes its
+// TLB when gen has moved (kvmflush), and the addresses are not
+// handed out again until every hart has.
+#define NVMAREA 64
+
+static struct {
+  struct spinlock lock;
+  uint64 gen;          // bumped by each vfree
+  struct {
+    uint64 va;         // 0 if the slot is unused
+    uint64 npages;
+    uint64 freed;      // gen at vfree, 0 while in use
+  } area[NVMAREA];
+} vm;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -25,8 +48,7 @@ void print(pagetable_t);
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t) kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  kernel_pagetable = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -52,6 +74,9 @@ kvminit()
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+
+  initlock(&vm.lock, "vmalloc");
+  vm.gen = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -86,9 +111,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -171,9 +195,10 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// Remove mappings from a page table. Pages in the
+// range that were never mapped, such as heap pages
+// that were never touched, are skipped. Optionally
+// free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
@@ -184,19 +209,18 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
-    }
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_V) != 0){
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      if(do_free){
+        pa = PTE2PA(*pte);
+        if(*pte & PTE_TEXT)
+          textfree(pa);
+        else
+          kfree((void*)pa);
+      }
+      *pte = 0;
     }
-    *pte = 0;
     if(a == last)
       break;
     a += PGSIZE;
@@ -209,10 +233,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     panic("uvmcreate: out of memory");
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -226,8 +249,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -246,12 +268,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   oldsz = PGROUNDUP(oldsz);
   a = oldsz;
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -270,7 +291,9 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   if(newsz >= oldsz)
     return oldsz;
-  uvmunmap(pagetable, newsz, oldsz - newsz, 1);
+  // keep the page that newsz ends in.
+  if(PGROUNDUP(newsz) < PGROUNDUP(oldsz))
+    uvmunmap(pagetable, PGROUNDUP(newsz), PGROUNDUP(oldsz) - PGROUNDUP(newsz), 1);
   return newsz;
 }
 
@@ -303,42 +326,155 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, map
+// its memory in [start, end) into a child's page table.
+// The physical pages are shared, not copied:
+// writable pages become read-only and copy-on-write
+// in both, and uvmcow copies them on the first store,
+// unless share is set, in which case they stay writable
+// and both see each other's stores.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    // the child faults in heap pages the parent never touched.
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    flags = PTE_FLAGS(*pte) & ~PTE_D;   // the child hasn't written it
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i, 1);
+  if(i > start)
+    uvmunmap(new, start, i - start, 1);
   return -1;
 }
 
+// Make the user page at va writable, if it is copy-on-write, by
+// copying it unless no other page table still shares it.
+// Returns 0 if the page is now writable, -1 if it is not a
+// copy-on-write page or there is no memory for the copy.
+static int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return -1;
+  if(*pte & PTE_W)
+    return 0;
+  if((*pte & PTE_COW) == 0)
+    return -1;
+
+  pa = PTE2PA(*pte);
+  if(kshared((void*)pa)){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | PTE_FLAGS(*pte);
+    kfree((void*)pa);
+  }
+  *pte = (*pte | PTE_W) & ~PTE_COW;
+  return 0;
+}
+
+// The current process, if pagetable is its page table; 0 otherwise,
+// so that copyin and copyout fault nothing in for exec.
+static struct proc*
+pgowner(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+  return p;
+}
+
+// Make the user page at va present and allow access acc (PTE_R,
+// PTE_W or PTE_X) to it, for a page fault or before the kernel
+// copies to or from it.  A page of a region (vma.c) that has not
+// been filled in yet is filled in; any other page below p->sz that
+// sbrk promised but nobody has touched yet is allocated and zeroed.
+// A copy-on-write page is copied on a write, and a written page is
+// marked dirty, since the kernel's own stores don't.
+// Reading a file page in locks its inode and may sleep, so it is
+// done only if io is set; the copy functions below set it only when
+// the caller holds no lock (copyio).
+// Returns 0 on success, -1 if va is not a user address the process
+// may access this way, if it needs a file page and io is 0, or if
+// memory is exhausted.
+int
+uvmfault(pagetable_t pagetable, uint64 va, int acc, int io)
+{
+  struct proc *p;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if((p = pgowner(pagetable)) == 0)
+      return -1;
+    if((v = vma_find(p, va)) != 0){
+      if((v->ip && !io) || vma_fault(pagetable, v, va) < 0)
+        return -1;
+    } else if(va < p->sz){
+      if((mem = kalloc_zeroed()) == 0)
+        return -1;
+      if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+        kfree(mem);
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_U) == 0)
+    return -1;
+  if(acc == PTE_W){
+    if(uvmcow(pagetable, va) < 0)
+      return -1;
+    *pte |= PTE_D;
+  }
+  return (*pte & acc) ? 0 : -1;
+}
+
+// The physical address of the page at va, if it is mapped and
+// dirty; otherwise 0.
+uint64
+uvmdirty(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+    return 0;
+  return PTE2PA(*pte);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,16 +488,37 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// May a copy to or from user memory read a file page in?  Only if
+// the caller holds no spinlock, since ilock sleeps, and no sleeplock,
+// which might be the very inode's or one of its buffers'.
+static int
+copyio(void)
+{
+  struct proc *p = myproc();
+  int ok;
+
+  push_off();
+  ok = mycpu()->noff == 1;
+  pop_off();
+  return ok && p && p->nsleeplock == 0;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// Pages not there yet are filled in, but a file page only if the
+// caller holds no lock; callers that copy with a lock held must
+// vma_prefault the range first, or the copy fails.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  int io = copyio();
 
   while(len > 0){
-    va0 = (uint)PGROUNDDOWN(dstva);
+    va0 = PGROUNDDOWN(dstva);
+    if(uvmfault(pagetable, va0, PTE_W, io) < 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -379,14 +536,18 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
+// Pages are filled in as for copyout.
 // Return 0 on success, -1 on error.
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  int io = copyio();
 
   while(len > 0){
-    va0 = (uint)PGROUNDDOWN(srcva);
+    va0 = PGROUNDDOWN(srcva);
+    if(uvmfault(pagetable, va0, PTE_R, io) < 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -404,16 +565,19 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
+// until a '\0', or max.  Pages are filled in as for copyout.
 // Return 0 on success, -1 on error.
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  int io = copyio();
 
   while(got_null == 0 && max > 0){
-    va0 = (uint)PGROUNDDOWN(srcva);
+    va0 = PGROUNDDOWN(srcva);
+    if(uvmfault(pagetable, va0, PTE_R, io) < 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -444,3 +608,168 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
     return -1;
   }
 }
+
+// Drop the areas freed long enough ago that every running hart has
+// flushed its TLB since.  Caller must hold vm.lock.
+static void
+vmreclaim(void)
+{
+  uint64 oldest = vm.gen;
+
+  for(int i = 0; i < NCPU; i++){
+    uint64 g = __atomic_load_n(&cpus[i].vmgen, __ATOMIC_ACQUIRE);
+    if(g != 0 && g < oldest)   // 0: not scheduling yet
+      oldest = g;
+  }
+  for(int i = 0; i < NVMAREA; i++)
+    if(vm.area[i].va && vm.area[i].freed && vm.area[i].freed <= oldest)
+      vm.area[i].va = 0;
+}
+
+// Allocate sz bytes of kernel memory, in whole pages that need not
+// be physically contiguous.  Returns 0 if there are not enough free
+// pages or addresses.
+void *
+vmalloc(uint64 sz)
+{
+  uint64 n = PGROUNDUP(sz) / PGSIZE, va, end;
+  int i, slot = -1;
+  char *mem;
+
+  if(n == 0 || n >= VMALLOC_SIZE / PGSIZE)
+    return 0;
+
+  acquire(&vm.lock);
+  vmreclaim();
+
+  // first fit: the lowest address whose n pages and guard page
+  // overlap no other area.
+  va = VMALLOC_BASE;
+  for(i = 0; i < NVMAREA; i++){
+    if(vm.area[i].va == 0){
+      if(slot < 0)
+        slot = i;
+      continue;
+    }
+    end = vm.area[i].va + (vm.area[i].npages + 1) * PGSIZE;
+    if(vm.area[i].va < va + (n + 1) * PGSIZE && va < end){
+      va = end;
+      i = -1;   // start over
+    }
+  }
+  if(slot < 0 || va + (n + 1) * PGSIZE > VMALLOC_BASE + VMALLOC_SIZE){
+    release(&vm.lock);
+    return 0;
+  }
+  // reserve the addresses, then fill them in without holding the
+  // lock across kalloc, which may have to run the shrinkers.
+  vm.area[slot].va = va;
+  vm.area[slot].npages = n;
+  vm.area[slot].freed = 0;
+  release(&vm.lock);
+
+  for(i = 0; i < n; i++){
+    if((mem = kalloc()) == 0)
+      break;
+    // mappages may add page-table pages that neighbouring areas share.
+    acquire(&vm.lock);
+    if(mappages(kernel_pagetable, va + i * PGSIZE, PGSIZE, (uint64)mem, PTE_R | PTE_W) != 0){
+      release(&vm.lock);
+      kfree(mem);
+      break;
+    }
+    release(&vm.lock);
+  }
+  if(i < n){
+    // give the addresses back as vfree would; nothing used them, but
+    // another hart may have cached a translation all the same.
+    acquire(&vm.lock);
+    if(i > 0)
+      uvmunmap(kernel_pagetable, va, i * PGSIZE, 1);
+    vm.area[slot].freed = ++vm.gen;
+    release(&vm.lock);
+    sfence_vma();
+    return 0;
+  }
+  sfence_vma();
+  return (void *)va;
+}
+
+// Free an area returned by vmalloc.
+void
+vfree(void *p)
+{
+  int i;
+
+  if(p == 0)
+    return;
+  acquire(&vm.lock);
+  for(i = 0; i < NVMAREA; i++)
+    if(vm.area[i].va == (uint64)p && vm.area[i].freed == 0)
+      break;
+  if(i == NVMAREA)
+    panic("vfree");
+  uvmunmap(kernel_pagetable, (uint64)p, vm.area[i].npages * PGSIZE, 1);
+  vm.area[i].freed = ++vm.gen;
+  release(&vm.lock);
+  sfence_vma();
+}
+
+// Flush this hart's TLB if an area has been vfree'd since it last
+// did, so that the area's addresses can be reused.  Called from the
+// scheduler loop.
+void
+kvmflush(void)
+{
+  struct cpu *c;
+  uint64 gen;
+
+  push_off();
+  c = mycpu();
+  gen = __atomic_load_n(&vm.gen, __ATOMIC_ACQUIRE);
+  if(c->vmgen != gen){
+    sfence_vma();
+    __atomic_store_n(&c->vmgen, gen, __ATOMIC_RELEASE);
+  }
+  pop_off();
+}
+
+// Check at boot that vmalloc areas hold their contents, and that
+// vfree'd addresses are handed out again only after this hart has
+// flushed its TLB.  Other harts are not scheduling yet, so their
+// flushes are not waited for.
+void
+vmalloc_selftest(void)
+{
+  char *a, *b, *c;
+  uint64 sz = 3*PGSIZE + 16;
+
+  kvmflush();
+  if((a = vmalloc(sz)) == 0 || (b = vmalloc(sz)) == 0)
+    panic("vmalloc_selftest: alloc");
+  if(b < a + 5*PGSIZE && a < b + 5*PGSIZE)
+    panic("vmalloc_selftest: overlap");
+  memset(a, 0xa, sz);
+  memset(b, 0xb, sz);
+  for(uint64 i = 0; i < sz; i++)
+    if(a[i] != 0xa || b[i] != 0xb)
+      panic("vmalloc_selftest: contents");
+
+  // a's addresses are not reused until after a flush.
+  vfree(a);
+  if((c = vmalloc(sz)) == 0)
+    panic("vmalloc_selftest: alloc");
+  if(c == a)
+    panic("vmalloc_selftest: reused before flush");
+  vfree(c);
+  kvmflush();
+  if((c = vmalloc(sz)) != a)
+    panic("vmalloc_selftest: not reused after flush");
+  memset(c, 0xc, sz);
+  if(b[0] != 0xb || b[sz-1] != 0xb)
+    panic("vmalloc_selftest: contents");
+  vfree(b);
+  vfree(c);
+  kvmflush();
+  printf("vmalloc: self-test ok\n");
+}
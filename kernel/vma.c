@@ -0,0 +1,535 @@
+// Regions of user memory filled in on demand: program segments and
+// mmap'd files and anonymous memory.
+//
+// exec does not read a program into memory.  It records each
+// loadable segment as a vma, and the first fault on a page of the
+// segment reads it in from the inode, along with up to READAROUND
+// following pages of the segment that are not there yet, so that a
+// program running through its text sequentially takes one fault per
+// window rather than per page.
+//
+// Filling a page locks the inode and may sleep, which a copy to or
+// from user memory can't do when it runs with a spinlock or the very
+// inode's lock held.  copyin and copyout read file pages in only when
+// the caller holds no lock.  System calls that copy with locks held
+// (read, write, wait) call vma_prefault first; a page that is still
+// missing makes the copy fail.
+//
+// Pages of read-only segments (VMA_TEXT: program text) are shared.
+// The text cache remembers them by inode, generation and file offset,
+// and they are mapped read-only, with PTE_TEXT, into every process
+// running the program; exec maps the ones already there straight
+// away.  The cache holds no reference of its own: kdup/kfree count
+// the mappings, and textfree drops a page from the cache along with
+// its last mapping.  Writing or truncating the file (textinval) bumps
+// the inode's generation.  A region looks up only pages of the
+// generation it was made from, so an exec of the new contents never
+// maps a page of the old, while processes still running the old
+// contents go on sharing theirs.  Pages of other segments are
+// private copies.
+//
+// mmap places regions from MMAPTOP down.  fork gives the child
+// copy-on-write copies of the pages of private regions.  A VMA_SHARED
+// region's pages are shared outright: fork fills them all in first,
+// then maps the same pages, writable, into the child, so parent and
+// child see each other's stores.  There is no page cache, so other
+// processes that map or read the file see a store only once munmap or
+// exit has written the dirty page back to the file, through the log.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define READAROUND 8   // pages filled per fault, at most
+#define NTEXT      256 // pages in the text cache
+
+static struct {
+  struct spinlock lock;
+  struct {
+    uint dev;
+    uint inum;
+    uint gen;          // the inode's generation when the page was read
+    uint off;          // file offset of the page
+    uint64 pa;         // 0 if the slot is unused
+  } pg[NTEXT];
+  uint64 nshared;      // mappings of a page already in the cache
+  uint64 ncopied;      // pages read from a file into a private page
+} text;
+
+void
+vmainit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+// A reference to the cached page for offset off of generation gen
+// of ip, or 0.
+static uint64
+textget(struct inode *ip, uint gen, uint off)
+{
+  uint64 pa = 0;
+
+  acquire(&text.lock);
+  for(int i = 0; i < NTEXT; i++){
+    if(text.pg[i].pa && text.pg[i].dev == ip->dev &&
+       text.pg[i].inum == ip->inum && text.pg[i].gen == gen &&
+       text.pg[i].off == off){
+      pa = text.pg[i].pa;
+      kdup((void*)pa);
+      text.nshared++;
+      break;
+    }
+  }
+  release(&text.lock);
+  return pa;
+}
+
+// Offer page pa, just read from offset off of ip, to the cache, as
+// a page of ip's current generation.  Returns the page to map: pa,
+// or the page already cached for off, in which case pa is freed.
+// Caller holds ip's lock, so textinval can't run between the read
+// and this.
+static uint64
+textadd(struct inode *ip, uint off, uint64 pa)
+{
+  int i, slot = -1;
+
+  acquire(&text.lock);
+  for(i = 0; i < NTEXT; i++){
+    if(text.pg[i].pa == 0){
+      if(slot < 0)
+        slot = i;
+    } else if(text.pg[i].dev == ip->dev && text.pg[i].inum == ip->inum &&
+              text.pg[i].gen == ip->gen && text.pg[i].off == off){
+      kfree((void*)pa);
+      pa = text.pg[i].pa;
+      kdup((void*)pa);
+      text.nshared++;
+      release(&text.lock);
+      return pa;
+    }
+  }
+  if(slot >= 0){
+    text.pg[slot].dev = ip->dev;
+    text.pg[slot].inum = ip->inum;
+    text.pg[slot].gen = ip->gen;
+    text.pg[slot].off = off;
+    text.pg[slot].pa = pa;
+  } else {
+    __sync_fetch_and_add(&text.ncopied, 1);   // cache full; stays private
+  }
+  release(&text.lock);
+  return pa;
+}
+
+// Drop a mapping of text page pa.  Under text.lock, so that no one
+// can find the page in the cache between its last kfree and its
+// removal.
+void
+textfree(uint64 pa)
+{
+  acquire(&text.lock);
+  if(!kshared((void*)pa)){
+    for(int i = 0; i < NTEXT; i++)
+      if(text.pg[i].pa == pa)
+        text.pg[i].pa = 0;
+  }
+  kfree((void*)pa);
+  release(&text.lock);
+}
+
+// ip's contents are changing; regions made from now on must not
+// find the pages cached so far.  Those stay for the processes that
+// map them, and go with their last mapping.  Caller holds ip's lock.
+void
+textinval(struct inode *ip)
+{
+  ip->gen++;
+}
+
+// Text cache hits and private file pages, for bdstat.
+void
+vmastat(uint64 *shared, uint64 *copied)
+{
+  acquire(&text.lock);
+  *shared = text.nshared;
+  *copied = text.ncopied;
+  release(&text.lock);
+}
+
+// Record [start, end) as filled from filesz bytes of ip at off (or
+// with zeros if ip is 0), mapped with PTE permissions perm, in the
+// first free slot of vma.  Takes a reference to ip, and notes its
+// generation; for a VMA_TEXT region the caller holds ip's lock, so
+// that is the generation of the contents the region will show.
+// Returns the slot, or 0 if all NVMA slots are in use.
+struct vma*
+vma_add(struct vma *vma, uint64 start, uint64 end, struct inode *ip, uint off, uint filesz,
+        int perm, int flags)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].end == 0){
+      vma[i].start = start;
+      vma[i].end = end;
+      vma[i].ip = ip ? idup(ip) : 0;
+      vma[i].off = off;
+      vma[i].filesz = filesz;
+      vma[i].perm = perm;
+      vma[i].flags = flags;
+      vma[i].gen = ip ? ip->gen : 0;
+      return &vma[i];
+    }
+  }
+  return 0;
+}
+
+// Drop region v.  Must not be called inside a transaction, since
+// it may be the last reference to the inode.
+static void
+vma_put(struct vma *v)
+{
+  if(v->ip){
+    begin_op(v->ip->dev);
+    iput(v->ip);
+    end_op(v->ip->dev);
+    v->ip = 0;
+  }
+  v->end = 0;
+}
+
+// The region of p containing va, or 0.
+struct vma*
+vma_find(struct proc *p, uint64 va)
+{
+  for(int i = 0; i < NVMA; i++)
+    if(p->vma[i].end && va >= p->vma[i].start && va < p->vma[i].end)
+      return &p->vma[i];
+  return 0;
+}
+
+// Fill in and map the page at va, which must be in v and not yet
+// mapped in pagetable, and, from a file, the pages after it up to
+// READAROUND.  Returns 0 if at least the page at va was mapped, -1
+// if not.
+int
+vma_fault(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 a, end, off, pa;
+  uint n;
+  char *mem;
+  int perm;
+
+  if(v->perm == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  perm = v->perm | PTE_U;
+
+  if(v->ip == 0){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  end = va + READAROUND * PGSIZE;
+  if(end > v->end)
+    end = v->end;
+  if(v->flags & VMA_TEXT)
+    perm |= PTE_TEXT;
+
+  ilock(v->ip);
+  for(a = va; a < end; a += PGSIZE){
+    if(a != va && walkaddr(pagetable, a) != 0)
+      break;
+    off = a - v->start;
+    if((v->flags & VMA_TEXT) == 0 || (pa = textget(v->ip, v->gen, v->off + off)) == 0){
+      if((mem = kalloc()) == 0)
+        break;
+      n = 0;
+      if(off < v->filesz){
+        n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+        if(readi(v->ip, 0, (uint64)mem, v->off + off, n) != n){
+          kfree(mem);
+          break;
+        }
+      }
+      memset(mem + n, 0, PGSIZE - n);
+      if(v->flags & VMA_TEXT){
+        pa = textadd(v->ip, v->off + off, (uint64)mem);
+      } else {
+        pa = (uint64)mem;
+        __sync_fetch_and_add(&text.ncopied, 1);
+      }
+    }
+    if(mappages(pagetable, a, PGSIZE, pa, perm) != 0){
+      if(v->flags & VMA_TEXT)
+        textfree(pa);
+      else
+        kfree((void*)pa);
+      break;
+    }
+  }
+  iunlock(v->ip);
+  return a > va ? 0 : -1;
+}
+
+// Map the pages of text region v that are in the cache already into
+// pagetable, for exec.  Caller holds v->ip's lock.
+void
+vma_mapcached(pagetable_t pagetable, struct vma *v)
+{
+  uint64 a, pa;
+
+  for(a = v->start; a < v->end; a += PGSIZE){
+    if((pa = textget(v->ip, v->gen, v->off + (a - v->start))) == 0)
+      continue;
+    if(mappages(pagetable, a, PGSIZE, pa, v->perm|PTE_U|PTE_TEXT) != 0){
+      textfree(pa);
+      return;
+    }
+  }
+}
+
+// Fill in the file pages of the current process's regions that
+// [va, va+len) touches, ahead of a copy to or from them made with a
+// lock held.  Must be called with no locks held.  A page that can't
+// be filled (memory is exhausted) stays missing, and the copy then
+// fails with -1.
+void
+vma_prefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  for(int i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->ip == 0 || va >= v->end || va + len <= v->start)
+      continue;
+    a = PGROUNDDOWN(va > v->start ? va : v->start);
+    end = va + len < v->end ? va + len : v->end;
+    for(; a < end; a += PGSIZE)
+      if(walkaddr(p->pagetable, a) == 0 && vma_fault(p->pagetable, v, a) < 0)
+        break;
+  }
+}
+
+// Write the dirty page at va of shared region v back to the file.
+// Only the part of the page that the file held when it was mapped,
+// and still holds, is written, so the file never grows.  A page
+// that another process shares may be written by both; they write
+// the same bytes.  Returns 0, or -1 if writei fell short.
+static int
+vma_writeback(struct vma *v, uint64 va, uint64 pa)
+{
+  // as in filewrite, a few blocks per transaction.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 off = va - v->start;
+  uint n, i, n1, fo;
+  int r = 0;
+
+  if(off >= v->filesz)
+    return 0;
+  n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+  for(i = 0; i < n && r == 0; i += n1){
+    n1 = n - i < max ? n - i : max;
+    fo = v->off + off + i;
+    begin_op(v->ip->dev);
+    ilock(v->ip);
+    if(fo >= v->ip->size)
+      n1 = n - i;   // truncated since; nothing more to write
+    else {
+      if(fo + n1 > v->ip->size)
+        n1 = v->ip->size - fo;
+      if(writei(v->ip, 0, pa + i, fo, n1) != n1)
+        r = -1;
+    }
+    iunlock(v->ip);
+    end_op(v->ip->dev);
+  }
+  return r;
+}
+
+// Unmap the pages of v in [a, b) from pagetable, first writing the
+// dirty ones back to the file if v is shared.  Returns 0, or -1 if
+// a page could not be written back; the pages are unmapped either
+// way.
+static int
+vma_unmappages(pagetable_t pagetable, struct vma *v, uint64 a, uint64 b)
+{
+  uint64 va, pa;
+  int r = 0;
+
+  if(a >= b)
+    return 0;
+  if((v->flags & VMA_SHARED) && v->ip){
+    for(va = a; va < b; va += PGSIZE)
+      if((pa = uvmdirty(pagetable, va)) != 0 && vma_writeback(v, va, pa) < 0)
+        r = -1;
+  }
+  uvmunmap(pagetable, a, b - a, 1);
+  return r;
+}
+
+// Find room for a region of len bytes below MMAPTOP, above where
+// the heap can grow, and record it in p.  Returns its address, or
+// -1 if there is no room or no free slot.
+uint64
+vma_map(struct proc *p, uint64 len, struct inode *ip, uint off, uint filesz, int perm, int flags)
+{
+  uint64 top = MMAPTOP;
+  struct vma *v;
+
+  len = PGROUNDUP(len);
+  for(int i = 0; i < NVMA; i++){
+    if(len > top || top - len < PHYSTOP - KERNBASE)
+      return -1;
+    v = &p->vma[i];
+    if(v->end && v->start < top && top - len < v->end){
+      top = v->start;
+      i = -1;   // start over
+    }
+  }
+  if(len > top || top - len < PHYSTOP - KERNBASE)
+    return -1;
+  if(vma_add(p->vma, top - len, top, ip, off, filesz, perm, flags) == 0)
+    return -1;
+  return top - len;
+}
+
+// Unmap [va, va+len) of p, in whole pages, from whatever regions it
+// overlaps.  A region that loses its middle is split in two.
+// Returns 0, or -1 if a split needs a slot and none is free (and
+// nothing is unmapped) or if a dirty page of a shared region could
+// not be written back (and it is unmapped all the same).
+int
+vma_unmap(struct proc *p, uint64 va, uint64 len)
+{
+  uint64 a = PGROUNDDOWN(va), b = PGROUNDUP(va + len), lo, hi, d;
+  struct vma *v, *w;
+  int i, nfree = 0, nsplit = 0, r = 0;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0)
+      nfree++;
+    else if(v->start < a && b < v->end)
+      nsplit++;
+  }
+  if(nsplit > nfree)
+    return -1;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0 || b <= v->start || v->end <= a)
+      continue;
+    lo = a > v->start ? a : v->start;
+    hi = b < v->end ? b : v->end;
+    if(vma_unmappages(p->pagetable, v, lo, hi) < 0)
+      r = -1;
+    if(lo == v->start && hi == v->end){
+      vma_put(v);
+      continue;
+    }
+    if(hi < v->end){
+      // keep [hi, end), in v or, if [start, lo) stays too, in w.
+      w = v;
+      if(lo > v->start){
+        w = vma_add(p->vma, v->start, v->end, v->ip, v->off, v->filesz, v->perm, v->flags);
+        w->gen = v->gen;
+        v->end = lo;
+        if(v->filesz > lo - v->start)
+          v->filesz = lo - v->start;
+      }
+      d = hi - w->start;
+      w->start = hi;
+      w->off += d;
+      w->filesz = w->filesz > d ? w->filesz - d : 0;
+    } else {
+      v->end = lo;
+      if(v->filesz > lo - v->start)
+        v->filesz = lo - v->start;
+    }
+  }
+  return r;
+}
+
+// Fill in every page of p's shared regions, so that fork can map
+// them all into the child.  Must be called with no locks held.
+// Returns 0, or -1 if there was no memory.
+int
+vma_fillshared(struct proc *p)
+{
+  struct vma *v;
+  uint64 a;
+
+  for(int i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0 || (v->flags & VMA_SHARED) == 0 || v->perm == 0)
+      continue;
+    for(a = v->start; a < v->end; a += PGSIZE)
+      if(walkaddr(p->pagetable, a) == 0 && vma_fault(p->pagetable, v, a) < 0)
+        return -1;
+  }
+  return 0;
+}
+
+// Copy p's regions to np, for fork.  uvmcopy has copied the pages
+// below p->sz; this copies those of the regions mmap placed above,
+// sharing the pages of VMA_SHARED regions, which vma_fillshared has
+// filled in, rather than making them copy-on-write.
+// Returns 0, or -1 if there was no memory, leaving np's regions and
+// the pages above p->sz as they were.
+int
+vma_dup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0 || v->start < p->sz)
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->start, v->end, v->flags & VMA_SHARED) < 0)
+      goto bad;
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      np->vma[i].ip = idup(p->vma[i].ip);
+  }
+  return 0;
+
+ bad:
+  while(--i >= 0){
+    v = &p->vma[i];
+    if(v->end && v->start >= p->sz)
+      uvmunmap(np->pagetable, v->start, v->end - v->start, 1);
+  }
+  return -1;
+}
+
+// Unmap all the regions in vma from pagetable, writing shared ones
+// back, and drop them.  pagetable may be 0 if nothing was mapped.
+// Must not be called inside a transaction.
+void
+vma_free(pagetable_t pagetable, struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].end == 0)
+      continue;
+    if(pagetable)
+      vma_unmappages(pagetable, &vma[i], vma[i].start, vma[i].end);
+    vma_put(&vma[i]);
+  }
+}
@@ -4,6 +4,7 @@
 #include "kernel/riscv.h"
 #include "kernel/fcntl.h"
 #include "kernel/memlayout.h"
+#include "kernel/bdstat.h"
 #include "user/user.h"
 
 void
@@ -59,8 +60,11 @@ void test1()
   int tot = 0;
   char buf[1];
   int fds[2];
+  struct bdstat st;
   
   printf("memtest: start\n");  
+  if(bdstat(&st) == 0)
+    printf("memtest: %l pages free\n", st.kmempages);
   if(pipe(fds) != 0){
     printf("pipe() failed\n");
     exit(1);
@@ -0,0 +1,31 @@
+#include "kernel/types.h"
+#include "kernel/bdstat.h"
+#include "user/user.h"
+
+// Print the buddy allocator's per-size block counts and counters.
+int
+main(int argc, char *argv[])
+{
+  struct bdstat st;
+
+  if(bdstat(&st) < 0){
+    fprintf(2, "bdstat: failed\n");
+    exit(1);
+  }
+
+  printf("order blksize free alloc\n");
+  for(int k = 0; k < st.norders; k++){
+    if(st.nfree[k] == 0 && st.nalloc[k] == 0)
+      continue;
+    printf("%d %l %l %l\n", k, st.leafsize << k, st.nfree[k], st.nalloc[k]);
+  }
+  printf("in use: %l bytes, free: %l bytes\n", st.inuse, st.freebytes);
+  printf("largest free block: %l bytes, fragmentation: %l/1000\n",
+         st.largest, st.fragindex);
+  printf("allocs %l frees %l splits %l merges %l\n",
+         st.nallocs, st.nfrees, st.nsplits, st.nmerges);
+  printf("free pages: %l\n", st.kmempages);
+  printf("shrinks %l reclaimed pages %l\n", st.nshrink, st.nreclaimed);
+  printf("file pages: shared %l copied %l\n", st.textshared, st.filecopied);
+  exit(0);
+}
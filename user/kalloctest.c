@@ -7,15 +7,18 @@
 
 #define NCHILD 2
 #define N 100000
+#define NBD 10000
 
 void test0();
 void test1();
+void test2();
 
 int
 main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
   exit(0);
 }
 
@@ -112,3 +115,32 @@ void test1()
   printf("test1 done\n");
 }
 
+// Parallel small-block buddy allocations: each child runs bdtest in
+// the kernel. With per-CPU magazines the test-and-set count should
+// stay low and the time should not grow with the number of CPUs.
+void test2()
+{
+  printf("start test2\n");
+  int n = ntas();
+  int t0 = uptime();
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(-1);
+    }
+    if(pid == 0){
+      if(bdtest(NBD) < 0){
+        printf("bdtest failed\n");
+        exit(-1);
+      }
+      exit(0);
+    }
+  }
+
+  for(int i = 0; i < NCHILD; i++){
+    wait(0);
+  }
+  int t = ntas();
+  printf("test2 done: #test-and-sets = %d, %d ticks\n", t - n, uptime() - t0);
+}
@@ -0,0 +1,279 @@
+//
+// tests for mmap() and munmap().
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+#define MAP_FAILED ((char*)0xffffffffffffffffL)
+
+char *testname = "???";
+char buf[PGSIZE];
+
+void
+err(char *why)
+{
+  printf("mmaptest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(-1);
+}
+
+// make a file of 2.5 pages, each byte holding 'A' + its page number.
+void
+makefile(const char *f)
+{
+  char buf[PGSIZE / 2];
+  int fd;
+
+  unlink(f);
+  if((fd = open(f, O_WRONLY | O_CREATE)) < 0)
+    err("open");
+  for(int i = 0; i < 5; i++){
+    memset(buf, 'A' + i / 2, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+      err("write");
+  }
+  close(fd);
+}
+
+// the file's bytes, then zeros up to the end of the last page.
+void
+checkfile(char *p)
+{
+  for(int i = 0; i < 3 * PGSIZE; i++){
+    char want = i < 5 * PGSIZE / 2 ? 'A' + i / PGSIZE : 0;
+    if(p[i] != want)
+      err("wrong content");
+  }
+}
+
+void
+privatetest()
+{
+  char *p;
+  int fd;
+
+  testname = "private";
+  printf("%s: ", testname);
+  makefile("mmap.dur");
+  if((fd = open("mmap.dur", O_RDONLY)) < 0)
+    err("open");
+  // writable private mappings of a read-only file are fine.
+  p = mmap(0, 3 * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  checkfile(p);
+  p[0] = 'Z';
+  if(munmap(p, 3 * PGSIZE) < 0)
+    err("munmap");
+
+  // the store must not have reached the file.
+  if((fd = open("mmap.dur", O_RDONLY)) < 0)
+    err("open");
+  p = mmap(0, 3 * PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  checkfile(p);
+  munmap(p, 3 * PGSIZE);
+
+  // MAP_SHARED and PROT_WRITE need a writable file.
+  if(mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED)
+    err("mmap of read-only file");
+  close(fd);
+  printf("ok\n");
+}
+
+void
+sharedtest()
+{
+  char *p;
+  int fd;
+
+  testname = "shared";
+  printf("%s: ", testname);
+  makefile("mmap.dur");
+  if((fd = open("mmap.dur", O_RDWR)) < 0)
+    err("open");
+  p = mmap(0, 3 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  checkfile(p);
+
+  // unmap the first page; the rest stays.
+  p[0] = 'a';
+  if(munmap(p, PGSIZE) < 0)
+    err("munmap first page");
+  p[PGSIZE] = 'b';
+  if(munmap(p + PGSIZE, 2 * PGSIZE) < 0)
+    err("munmap the rest");
+
+  // both stores, and nothing past the end of the file, were written.
+  struct stat st;
+  if((fd = open("mmap.dur", O_RDONLY)) < 0)
+    err("open");
+  if(fstat(fd, &st) < 0 || st.size != 5 * PGSIZE / 2)
+    err("file size changed");
+  if(read(fd, buf, 1) != 1 || buf[0] != 'a')
+    err("first page not written back");
+  if(read(fd, buf, PGSIZE - 1) != PGSIZE - 1 || read(fd, buf, 1) != 1 || buf[0] != 'b')
+    err("second page not written back");
+  close(fd);
+  unlink("mmap.dur");
+  printf("ok\n");
+}
+
+void
+sharedforktest()
+{
+  char *p, *q;
+  int fd, pid, xstatus;
+
+  testname = "shared fork";
+  printf("%s: ", testname);
+  makefile("mmap.dur");
+  if((fd = open("mmap.dur", O_RDWR)) < 0)
+    err("open");
+  p = mmap(0, 3 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  q = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(q == MAP_FAILED)
+    err("mmap anonymous");
+
+  // no page has been touched yet; the child must share them all.
+  pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0){
+    p[0] = 'c';
+    p[2 * PGSIZE] = 'e';
+    q[0] = 'q';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child failed");
+  if(p[0] != 'c' || p[2 * PGSIZE] != 'e' || q[0] != 'q')
+    err("child's stores not seen");
+  p[1] = 'p';
+  if(munmap(p, 3 * PGSIZE) < 0 || munmap(q, PGSIZE) < 0)
+    err("munmap");
+
+  // the child's exit and the parent's munmap wrote back the same
+  // pages; neither undid the other's stores.
+  if((fd = open("mmap.dur", O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'c' || buf[1] != 'p' || buf[2] != 'A')
+    err("first page not written back");
+  if(read(fd, buf, PGSIZE) != PGSIZE || read(fd, buf, 1) != 1 || buf[0] != 'e')
+    err("third page not written back");
+  close(fd);
+  unlink("mmap.dur");
+  printf("ok\n");
+}
+
+void
+anontest()
+{
+  char *p, *q;
+  int pid, xstatus;
+
+  testname = "anonymous";
+  printf("%s: ", testname);
+  p = mmap(0, 4 * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  for(int i = 0; i < 4 * PGSIZE; i += PGSIZE){
+    if(p[i] != 0)
+      err("not zero");
+    p[i] = i / PGSIZE + 1;
+  }
+
+  // punch a hole in the middle; the two ends stay.
+  if(munmap(p + PGSIZE, 2 * PGSIZE) < 0)
+    err("munmap middle");
+  if(p[0] != 1 || p[3 * PGSIZE] != 4)
+    err("ends lost");
+
+  // the child sees the parent's pages, and its stores stay its own.
+  pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0){
+    if(p[0] != 1 || p[3 * PGSIZE] != 4)
+      exit(1);
+    p[0] = 9;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child saw wrong content");
+  if(p[0] != 1)
+    err("child store reached parent");
+
+  // a second mapping must not overlap the first.
+  q = mmap(0, 2 * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(q == MAP_FAILED)
+    err("second mmap");
+  if(q + 2 * PGSIZE > p && q < p + 4 * PGSIZE && q != p + PGSIZE)
+    err("overlap");
+  q[0] = 7;
+  munmap(q, 2 * PGSIZE);
+  munmap(p, PGSIZE);
+  munmap(p + 3 * PGSIZE, PGSIZE);
+  printf("ok\n");
+}
+
+void
+faulttest()
+{
+  char *p;
+  int pid, xstatus;
+
+  testname = "fault";
+  printf("%s: ", testname);
+  p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+
+  // a store to a read-only mapping kills the process.
+  pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0){
+    p[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("store to read-only mapping succeeded");
+
+  // so does a load after munmap.
+  munmap(p, PGSIZE);
+  pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0)
+    exit(p[0]);
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("load from unmapped page succeeded");
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  privatetest();
+  sharedtest();
+  sharedforktest();
+  anontest();
+  faulttest();
+  printf("ALL MMAP TESTS PASSED\n");
+  exit(0);
+}
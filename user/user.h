@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct bdstat;
 
 // system calls
 int fork(void);
@@ -29,6 +30,10 @@ int mount(char*, char *);
 int umount(char*);
 int getprocs(void);
 uint64 demo(void);
+int bdtest(int);
+int bdstat(struct bdstat*);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
 
 
 // ulib.c
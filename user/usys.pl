@@ -41,4 +41,8 @@ entry("crash");
 entry("mount");
 entry("umount");
 entry("getprocs");
-entry("demo");
\ No newline at end of file
+entry("demo");
+entry("bdtest");
+entry("bdstat");
+entry("mmap");
+entry("munmap");
\ No newline at end of file